@@ -0,0 +1,584 @@
+/// @file bench.cc
+/// @brief denoising benchmarks
+/// @author Jeff Perry <jeffsp@gmail.com>
+/// @version 1.0
+/// @date 2015-07-05
+
+#include "denoise.h"
+#include <omp.h>
+#include <sstream>
+
+using namespace opp;
+using namespace std;
+using namespace denoise;
+using namespace horny_toad;
+using namespace jack_rabbit;
+
+const string usage = "usage: bench train < file_list.txt\n"
+    "       bench lookup fn.lut < file_list.txt\n"
+    "       bench shapes < file_list.txt\n"
+    "       bench counts < file_list.txt\n"
+    "       bench batch fn.lut < file_list.txt\n"
+    "       bench hot fn.lut < file_list.txt\n"
+    "       bench blur [fn.wisdom] < file_list.txt";
+
+/// @brief train all passes, merging each image into the shared table
+void train_per_image (multi_codec<PASSES> &c, const images_t &ps, const images_t &qs)
+{
+    for (size_t pass = 0; pass < c.lut_passes (); ++pass)
+    {
+#pragma omp parallel for schedule (dynamic)
+        for (size_t n = 0; n < ps.size (); ++n)
+            c.update (ps[n], qs[n], pass);
+        c.finalize (pass);
+    }
+}
+
+/// @brief train all passes, merging each worker's table at the end of the pass
+template<typename M>
+void train_per_worker (M &c, const images_t &ps, const images_t &qs)
+{
+    for (size_t pass = 0; pass < c.lut_passes (); ++pass)
+    {
+#pragma omp parallel
+        {
+            lut1<size_t> l;
+#pragma omp for schedule (dynamic) nowait
+            for (size_t n = 0; n < ps.size (); ++n)
+                c.update (ps[n], qs[n], pass, l);
+#pragma omp critical
+            c.merge (pass, l);
+        }
+        c.finalize (pass);
+    }
+}
+
+/// @brief read the clean and noisy images of a file list
+void read_pairs (const vector<string> &fns, images_t &ps, images_t &qs)
+{
+    for (size_t n = 0; n + 1 < fns.size (); n += 2)
+    {
+        ps.push_back (read_grayscale (fns[n].c_str ()));
+        qs.push_back (read_grayscale (fns[n + 1].c_str ()));
+    }
+    clog << ps.size () << " image pairs, " << PASSES << " passes" << endl;
+}
+
+/// @brief read the noisy images of a file list
+///
+/// @param fns clean and noisy file names
+/// @param pixels set to the number of pixels in the images
+images_t read_noisy (const vector<string> &fns, size_t &pixels)
+{
+    images_t qs;
+    pixels = 0;
+    for (size_t n = 1; n < fns.size (); n += 2)
+    {
+        qs.push_back (read_grayscale (fns[n].c_str ()));
+        pixels += qs.back ().size ();
+    }
+    return qs;
+}
+
+/// @brief time training on 1 to N cores
+void bench_train (const vector<string> &fns)
+{
+    // read the training set up front so that only training is timed
+    images_t ps, qs;
+    read_pairs (fns, ps, qs);
+    const int procs = omp_get_num_procs ();
+    vector<int> threads;
+    for (int t = 1; t < procs; t *= 2)
+        threads.push_back (t);
+    threads.push_back (procs);
+    double base[2] = { 0.0, 0.0 };
+    for (auto t : threads)
+    {
+        omp_set_num_threads (t);
+        double secs[2];
+        timer tm;
+        {
+            multi_codec<PASSES> c;
+            tm.tic ();
+            train_per_image (c, ps, qs);
+            secs[0] = tm.toc ();
+        }
+        {
+            multi_codec<PASSES> c;
+            tm.tic ();
+            train_per_worker (c, ps, qs);
+            secs[1] = tm.toc ();
+        }
+        if (t == 1)
+        {
+            base[0] = secs[0];
+            base[1] = secs[1];
+        }
+        cout << t << " threads"
+            << "\tper image " << secs[0] << "s (" << base[0] / secs[0] << "x)"
+            << "\tper worker " << secs[1] << "s (" << base[1] / secs[1] << "x)"
+            << endl;
+    }
+}
+
+/// @brief time the scalar and vectorized context lookups
+void bench_lookup (const vector<string> &fns, const char *lut)
+{
+    multi_codec<PASSES> c;
+    c.map (lut);
+    size_t pixels;
+    const images_t qs = read_noisy (fns, pixels);
+    const unsigned char *t = c.table (0);
+    vector<unsigned char> q;
+    const size_t REPS = 20;
+    for (int avx2 = 0; avx2 < 1 + have_avx2 (); ++avx2)
+    {
+        timer tm;
+        tm.tic ();
+        for (size_t rep = 0; rep < REPS; ++rep)
+        {
+            for (const auto &p : qs)
+            {
+                q.resize (p.cols ());
+                for (size_t i = 1; i + 1 < p.rows (); ++i)
+                {
+                    // vertical contexts
+                    const unsigned char *a = &p (i - 1, 0);
+                    const unsigned char *b = &p (i, 0);
+                    const unsigned char *d = &p (i + 1, 0);
+                    if (avx2)
+                        lookup888_avx2 (a, b, d, &q[0], p.cols (), t);
+                    else
+                        lookup888_scalar (a, b, d, &q[0], p.cols (), t);
+                }
+            }
+        }
+        const double secs = tm.toc ();
+        cout << (avx2 ? "avx2  " : "scalar") << "\t" << REPS * pixels / secs / 1e6 << " Mpixels/s" << endl;
+    }
+}
+
+/// @brief compare denoising images one at a time to denoising them as a batch
+void bench_batch (const vector<string> &fns, const char *lut)
+{
+    multi_codec<PASSES> c;
+    c.map (lut);
+    size_t pixels;
+    const images_t qs = read_noisy (fns, pixels);
+    const size_t REPS = 10;
+    images_t ps (qs.size ());
+    timer tm;
+    tm.tic ();
+    for (size_t rep = 0; rep < REPS; ++rep)
+        for (size_t n = 0; n < qs.size (); ++n)
+            ps[n] = c.denoise (qs[n]);
+    const double secs = tm.toc ();
+    tm.tic ();
+    images_t bs;
+    for (size_t rep = 0; rep < REPS; ++rep)
+        bs = c.denoise (qs);
+    const double batch_secs = tm.toc ();
+    if (bs != ps)
+        throw runtime_error ("the batch differs from the single images");
+    cout << qs.size () << " images, " << omp_get_max_threads () << " threads" << endl;
+    cout << "single\t" << REPS * pixels / secs / 1e6 << " Mpixels/s" << endl;
+    cout << "batch\t" << REPS * pixels / batch_secs / 1e6 << " Mpixels/s" << endl;
+}
+
+/// @brief a set associative cache with lru replacement
+class cache_model
+{
+    public:
+    /// @brief constructor
+    ///
+    /// @param bytes cache size
+    /// @param ways associativity
+    cache_model (size_t bytes, size_t ways)
+        : misses (0)
+        , ways (ways)
+        , sets (bytes / LINE / ways)
+        , tags (sets * ways, ~uint64_t (0))
+    { }
+    void access (uint64_t addr)
+    {
+        const uint64_t line = addr / LINE;
+        uint64_t *t = &tags[(line % sets) * ways];
+        size_t k = 0;
+        while (k < ways && t[k] != line)
+            ++k;
+        if (k == ways)
+        {
+            ++misses;
+            --k;
+        }
+        // most recently used first
+        for (; k > 0; --k)
+            t[k] = t[k - 1];
+        t[0] = line;
+    }
+    size_t misses;
+    private:
+    static const size_t LINE = 64;
+    const size_t ways;
+    const size_t sets;
+    vector<uint64_t> tags;
+};
+
+/// @brief profile the contexts that denoising looks up, and try hot tables
+///
+/// Cache misses are from a model of the table reads, a pass at a time,
+/// because there are no hardware counters to read here.
+void bench_hot (const vector<string> &fns, const char *lut)
+{
+    multi_codec<PASSES> c;
+    c.map (lut);
+    size_t pixels;
+    const images_t qs = read_noisy (fns, pixels);
+    lut1<size_t> hits[PASSES];
+    for (const auto &q : qs)
+        c.profile (q, hits);
+    // the contexts of each pass, in the order they are looked up, on
+    // the mirrored images that profile () and denoise () see
+    const size_t K = context::kernel_size ();
+    vector<uint32_t> trace[PASSES];
+    for (const auto &q : qs)
+    {
+        image_t t (q);
+        for (size_t pass = 0; pass < PASSES; ++pass)
+        {
+            const bool h = !(pass & 1);
+            vector<uint32_t> idx (t.cols ());
+            for (size_t i = K / 2; i + K / 2 < t.rows (); ++i)
+            {
+                const unsigned char *r[3] = { &t (i - 1, 0), &t (i, 0), &t (i + 1, 0) };
+                context::index (r, K / 2, t.cols () - K / 2, h, &idx[0]);
+                trace[pass].insert (trace[pass].end (), idx.begin (), idx.end () - (K - 1));
+            }
+            t = c.pass_codec (pass).denoise (t, h, true);
+        }
+    }
+    for (size_t pass = 0; pass < PASSES; ++pass)
+        cout << "pass " << pass + 1 << "\t" << hits[pass].size () << " contexts\t" << trace[pass].size () << " lookups" << endl;
+    const images_t expected = c.denoise (qs);
+    const size_t REPS = 10;
+    const size_t ks[] = { 0, 256, 1024, 4096, 16384, 65536 };
+    for (auto k : ks)
+    {
+        size_t bytes = 0;
+        for (size_t pass = 0; pass < PASSES; ++pass)
+        {
+            c.hot (pass, hits[pass], k);
+            bytes += c.pass_codec (pass).hot_table_size ();
+        }
+        size_t lookups = 0;
+        size_t found = 0;
+        cache_model l1 (32 << 10, 8);
+        cache_model l2 (1 << 20, 16);
+        for (size_t pass = 0; pass < PASSES; ++pass)
+        {
+            const sparse_table &h = c.pass_codec (pass).hot_table ();
+            const uint64_t dense = uint64_t (pass) << 32;
+            const uint64_t hot = (uint64_t (PASSES + pass) << 32);
+            for (auto i : trace[pass])
+            {
+                vector<uint64_t> a;
+                unsigned char v;
+                if (k != 0)
+                {
+                    a.push_back (hot + h.home (i) * sizeof (uint32_t));
+                    if (h.find (i, v))
+                    {
+                        ++found;
+                        a.push_back (hot + h.slots () * sizeof (uint32_t) + h.home (i));
+                    }
+                    else
+                        a.push_back (dense + i);
+                }
+                else
+                    a.push_back (dense + i);
+                for (auto x : a)
+                {
+                    const size_t m = l1.misses;
+                    l1.access (x);
+                    if (l1.misses != m)
+                        l2.access (x);
+                }
+                ++lookups;
+            }
+        }
+        timer tm;
+        tm.tic ();
+        images_t ps;
+        for (size_t rep = 0; rep < REPS; ++rep)
+            ps = c.denoise (qs);
+        const double secs = tm.toc ();
+        if (ps != expected)
+            throw runtime_error ("the hot table changed the output");
+        cout << "hot " << k
+            << "\t" << bytes << " bytes"
+            << "\t" << 100.0 * found / lookups << "% hits"
+            << "\tL1 misses " << 1000.0 * l1.misses / lookups << "/1000"
+            << "\tL2 misses " << 1000.0 * l2.misses / lookups << "/1000"
+            << "\t" << REPS * pixels / secs / 1e6 << " Mpixels/s"
+            << endl;
+    }
+}
+
+/// @brief the 2D gaussian_blur () that the separable one replaced
+template<typename T>
+T gaussian_blur_2d (const T &p, size_t kernel, double stddev, size_t scale)
+{
+    const size_t ROWS = p.rows () / scale;
+    const size_t COLS = p.cols () / scale;
+    T q (ROWS, COLS);
+    raster<double> g (kernel, kernel, 1.0);
+    subscript_unary_function<double,gaussian_window> f (g.rows (), g.cols ());
+    f.stddev (stddev);
+    transform (g.begin (), g.end (), g.begin (), f);
+    double sum = accumulate (g.begin (), g.end (), 0.0);
+    for (size_t i = 0; i < g.size (); ++i)
+        g[i] /= sum;
+    for (size_t i = 0; i < ROWS; ++i)
+    {
+        unsigned i2 = i * scale;
+        for (size_t j = 0; j < COLS; ++j)
+        {
+            unsigned j2 = j * scale;
+            q (i, j) = mirrored_dot_product (g, p, i2 - (kernel - 1) / 2, j2 - (kernel - 1) / 2);
+        }
+    }
+    return q;
+}
+
+/// @brief compare gaussian_blur (), which is separable or uses FFTs,
+/// to the 2D one
+///
+/// The first blur of each image size plans its FFTs, so it is timed
+/// on its own, and then every image is timed with the plans warm.
+///
+/// With a wisdom file, the plans are measured and the measurements
+/// are saved to it, so only the first run pays for them.
+void bench_blur (const vector<string> &fns, const char *wisdom)
+{
+    if (wisdom)
+        use_fft_wisdom (wisdom);
+    size_t pixels;
+    const images_t qs = read_noisy (fns, pixels);
+    // one image of each size
+    images_t sizes;
+    for (const auto &q : qs)
+    {
+        bool seen = false;
+        for (const auto &s : sizes)
+            seen = seen || (s.rows () == q.rows () && s.cols () == q.cols ());
+        if (!seen)
+            sizes.push_back (q);
+    }
+    for (size_t k = 3; k <= 41; k += 2)
+    {
+        for (size_t scale = 1; scale <= 2; ++scale)
+        {
+            const double stddev = k / 5.0;
+            timer tm;
+            images_t a;
+            tm.tic ();
+            for (const auto &q : qs)
+                a.push_back (gaussian_blur_2d (q, k, stddev, scale));
+            const double secs2d = tm.toc ();
+            tm.tic ();
+            for (const auto &q : sizes)
+                gaussian_blur (q, k, stddev, scale);
+            const double first_secs = tm.toc ();
+            images_t b;
+            tm.tic ();
+            for (const auto &q : qs)
+                b.push_back (gaussian_blur (q, k, stddev, scale));
+            const double secs = tm.toc ();
+            // the sums are added in a different order, so a value can
+            // land on the other side of an integer
+            int max_diff = 0;
+            size_t diffs = 0;
+            for (size_t n = 0; n < a.size (); ++n)
+            {
+                for (size_t i = 0; i < a[n].size (); ++i)
+                {
+                    const int d = abs (int (a[n][i]) - int (b[n][i]));
+                    max_diff = max (max_diff, d);
+                    diffs += d != 0;
+                }
+            }
+            if (max_diff > 1)
+                throw runtime_error ("the fast blur is wrong");
+            cout << "kernel " << k << "\tscale " << scale
+                << "\t2D " << pixels / secs2d / 1e6 << " Mpixels/s"
+                << "\t" << (scale == 1 && k >= GAUSSIAN_BLUR_FFT_KERNEL ? "fft " : "separable ")
+                << pixels / secs / 1e6 << " Mpixels/s"
+                << "\t" << secs2d / secs << "x"
+                << "\t" << diffs << " pixels off by one"
+                << "\tfirst calls " << first_secs * 1000 << " ms"
+                << endl;
+        }
+    }
+    if (wisdom && !save_fft_wisdom (wisdom))
+        throw runtime_error ("could not write the wisdom file");
+}
+
+/// @brief train and run a context shape on the training set
+template<typename C>
+void bench_shape (const char *name, const images_t &ps, const images_t &qs)
+{
+    multi_codec<PASSES,C> c;
+    timer tm;
+    tm.tic ();
+    train_per_worker (c, ps, qs);
+    const double train_secs = tm.toc ();
+    size_t lut_bytes = 0;
+    size_t contexts = 0;
+    for (size_t pass = 0; pass < c.lut_passes (); ++pass)
+        contexts += c.lut (pass).size ();
+    {
+        ostringstream s;
+        s << c;
+        lut_bytes = s.str ().size ();
+    }
+    // denoise the way denoise does, and time only the passes
+    double secs = 0.0;
+    double err = 0.0;
+    size_t pixels = 0;
+    for (size_t n = 0; n < qs.size (); ++n)
+    {
+        tm.tic ();
+        const image_t p = c.denoise (qs[n]);
+        secs += tm.toc ();
+        err += sse (p, ps[n]);
+        pixels += p.size ();
+    }
+    cout << name
+        << "\t" << C::bits () << " bits"
+        << "\t" << (codec<C>::sparse () ? "sparse" : "dense")
+        << "\t" << contexts << " contexts"
+        << "\t" << lut_bytes << " lut bytes"
+        << "\ttrain " << train_secs << "s"
+        << "\t" << pixels / secs / 1e6 << " Mpixels/s"
+        << "\tpsnr " << psnr (err / pixels) << endl;
+}
+
+/// @brief compare the context shapes
+///
+/// The error is measured on the training set, so it favors the shapes
+/// with more contexts.
+void bench_shapes (const vector<string> &fns)
+{
+    images_t ps, qs;
+    read_pairs (fns, ps, qs);
+    double err = 0.0;
+    size_t pixels = 0;
+    for (size_t n = 0; n < ps.size (); ++n)
+    {
+        err += sse (qs[n], ps[n]);
+        pixels += ps[n].size ();
+    }
+    cout << "noisy\tpsnr " << psnr (err / pixels) << endl;
+    bench_shape<context> ("1x3", ps, qs);
+    bench_shape<context_diagonal> ("diagonal", ps, qs);
+    bench_shape<context_2x2> ("2x2", ps, qs);
+    bench_shape<context_plus> ("plus", ps, qs);
+}
+
+/// @brief check that two luts hold the same counts
+template<typename A,typename B>
+void check_counts (const A &a, const B &b, const char *name)
+{
+    bool same = a.size () == b.size ();
+    b.for_each ([&] (size_t i, uint64_t total, uint64_t sum)
+    {
+        same = same && a.total (i) == total && a.sum (i) == sum;
+    });
+    if (!same)
+        throw runtime_error (string ("the ") + name + " counters lost counts");
+}
+
+/// @brief check that narrow counters count the training set exactly
+///
+/// Every pass is counted with 64, 32 and 16 bit counters.  The 16 bit
+/// counters overflow on real data, so they check that promotion works.
+void bench_counts (const vector<string> &fns)
+{
+    images_t ps, ts;
+    read_pairs (fns, ps, ts);
+    multi_codec<PASSES> c;
+    for (size_t pass = 0; pass < c.lut_passes (); ++pass)
+    {
+        lut1<size_t,uint64_t> l64;
+        lut1<size_t,uint32_t> l32;
+        lut1<size_t,uint16_t> l16;
+        double secs[2] = { 0.0, 0.0 };
+        timer tm;
+        for (size_t n = 0; n < ps.size (); ++n)
+        {
+            tm.tic ();
+            codec<context>::update (l64, ps[n], ts[n], !(pass & 1));
+            secs[0] += tm.toc ();
+            tm.tic ();
+            codec<context>::update (l32, ps[n], ts[n], !(pass & 1));
+            secs[1] += tm.toc ();
+            codec<context>::update (l16, ps[n], ts[n], !(pass & 1));
+        }
+        check_counts (l32, l64, "32 bit");
+        check_counts (l16, l64, "16 bit");
+        uint64_t max_total = 0;
+        uint64_t max_sum = 0;
+        l64.for_each ([&] (size_t, uint64_t total, uint64_t sum)
+        {
+            max_total = max (max_total, total);
+            max_sum = max (max_sum, sum);
+        });
+        cout << "pass " << pass + 1
+            << "\t" << l64.size () << " contexts"
+            << "\tmax total " << max_total
+            << "\tmax sum " << max_sum
+            << "\tpromoted " << l32.promoted () << " at 32 bits, " << l16.promoted () << " at 16 bits"
+            << "\tcount 64 bit " << secs[0] << "s, 32 bit " << secs[1] << "s"
+            << endl;
+        c.merge (pass, l32);
+        c.finalize (pass);
+        for (size_t n = 0; n < ts.size (); ++n)
+            ts[n] = c.denoise (ts[n], pass);
+    }
+    cout << "all counts match" << endl;
+}
+
+int main (int argc, char **argv)
+{
+    try
+    {
+        if (argc < 2 || argc > 3)
+            throw runtime_error (usage);
+        const string mode (argv[1]);
+        vector<string> fns = horny_toad::readwords<string> (cin);
+        if (fns.size () % 2)
+            throw runtime_error ("you must supply an even number of file names");
+        if (mode == "train" && argc == 2)
+            bench_train (fns);
+        else if (mode == "lookup" && argc == 3)
+            bench_lookup (fns, argv[2]);
+        else if (mode == "shapes" && argc == 2)
+            bench_shapes (fns);
+        else if (mode == "counts" && argc == 2)
+            bench_counts (fns);
+        else if (mode == "batch" && argc == 3)
+            bench_batch (fns, argv[2]);
+        else if (mode == "hot" && argc == 3)
+            bench_hot (fns, argv[2]);
+        else if (mode == "blur")
+            bench_blur (fns, argc == 3 ? argv[2] : 0);
+        else
+            throw runtime_error (usage);
+        return 0;
+    }
+    catch (const exception &e)
+    {
+        cerr << e.what () << endl;
+        return -1;
+    }
+}
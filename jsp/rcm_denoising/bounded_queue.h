@@ -0,0 +1,77 @@
+/// @file bounded_queue.h
+/// @brief blocking producer/consumer queue
+/// @author Jeff Perry <jeffsp@gmail.com>
+/// @version 1.0
+/// @date 2015-07-08
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace opp
+{
+    /// @brief a queue that holds at most a fixed number of items
+    ///
+    /// Producers block in push () while the queue is full, and consumers
+    /// block in pop () while it is empty.  Once the queue is closed,
+    /// pushes fail, and pops fail after the queue has drained.
+    ///
+    /// @tparam T item type
+    template<typename T>
+    class bounded_queue
+    {
+        public:
+        explicit bounded_queue (size_t capacity)
+            : capacity (capacity)
+            , closed (false)
+        { }
+        /// @brief add an item, waiting for room
+        ///
+        /// @return false if the queue was closed, in which case x is unchanged
+        bool push (T &x)
+        {
+            std::unique_lock<std::mutex> lock (m);
+            not_full.wait (lock, [&] { return closed || q.size () < capacity; });
+            if (closed)
+                return false;
+            q.push_back (T ());
+            q.back ().swap (x);
+            not_empty.notify_one ();
+            return true;
+        }
+        /// @brief remove an item, waiting for one to arrive
+        ///
+        /// @return false if the queue is closed and empty
+        bool pop (T &x)
+        {
+            std::unique_lock<std::mutex> lock (m);
+            not_empty.wait (lock, [&] { return closed || !q.empty (); });
+            if (q.empty ())
+                return false;
+            x.swap (q.front ());
+            q.pop_front ();
+            not_full.notify_one ();
+            return true;
+        }
+        /// @brief stop accepting items and wake up everyone who is waiting
+        void close ()
+        {
+            std::lock_guard<std::mutex> lock (m);
+            closed = true;
+            not_full.notify_all ();
+            not_empty.notify_all ();
+        }
+        private:
+        const size_t capacity;
+        bool closed;
+        std::deque<T> q;
+        std::mutex m;
+        std::condition_variable not_full;
+        std::condition_variable not_empty;
+    };
+}
+
+#endif
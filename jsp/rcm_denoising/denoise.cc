@@ -5,6 +5,8 @@
 /// @date 2013-11-25
 
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include "denoise.h"
 
 using namespace horny_toad;
@@ -13,36 +15,248 @@ using namespace denoise;
 using namespace opp;
 using namespace std;
 
-const string usage = "usage: denoise fn.lut < fn";
+const string usage = "usage: denoise fn.lut < fn\n"
+    "       denoise fn.lut --list < file_list.txt\n"
+    "       denoise fn.lut --stream < images > images\n"
+    "       denoise fn.lut --rows < fn > fn";
+
+/// @brief denoise an image a row at a time
+///
+/// Rows are read and written as they are needed, so very tall images
+/// can be denoised in a fixed amount of memory.
+void denoise_rows (const multi_codec<PASSES> &c, istream &is, ostream &os)
+{
+    bool rgb, bpp16;
+    size_t w, h;
+    read_pnm_header (is, rgb, bpp16, w, h);
+    if (rgb)
+        throw runtime_error ("the file is not grayscale");
+    if (bpp16)
+        throw runtime_error ("the file is not 8 bit");
+    write_pnm_header (os, w, h);
+    c.denoise_rows (h, w, [&] (unsigned char *p)
+    {
+        if (!is.read (reinterpret_cast<char *> (p), w))
+            throw runtime_error ("truncated image");
+    },
+    [&] (size_t, const unsigned char *q)
+    {
+        os.write (reinterpret_cast<const char *> (q), w);
+    });
+    if (!os)
+        throw runtime_error ("could not write image");
+}
+
+/// @brief an image on its way through the server
+struct job
+{
+    string name;
+    string output;
+    image_t p;
+    timer t;
+};
+
+/// @brief latency and throughput of a server run
+class server_stats
+{
+    public:
+    server_stats ()
+        : pixels (0)
+    {
+        t.tic ();
+    }
+    void add (const job &j, double secs)
+    {
+        latencies.push_back (secs);
+        pixels += j.p.size ();
+        clog << j.name << "\t" << j.p.cols () << "x" << j.p.rows ()
+            << "\t" << secs * 1000 << " ms" << endl;
+    }
+    void report (ostream &s)
+    {
+        const double secs = t.toc ();
+        s << latencies.size () << " images, "
+            << pixels / 1e6 << " Mpixels in "
+            << secs << "s, "
+            << latencies.size () / secs << " images/s, "
+            << pixels / secs / 1e6 << " Mpixels/s" << endl;
+        if (latencies.empty ())
+            return;
+        sort (latencies.begin (), latencies.end ());
+        const double mean = accumulate (latencies.begin (), latencies.end (), 0.0) / latencies.size ();
+        s << "latency ms: mean " << mean * 1000
+            << ", p50 " << percentile (0.50) * 1000
+            << ", p95 " << percentile (0.95) * 1000
+            << ", max " << latencies.back () * 1000 << endl;
+    }
+    private:
+    double percentile (double x) const
+    {
+        return latencies[min (latencies.size () - 1, size_t (x * latencies.size ()))];
+    }
+    timer t;
+    vector<double> latencies;
+    size_t pixels;
+};
+
+/// @brief denoise a stream of images on all cores
+///
+/// @param c the codec, which is shared by the workers
+/// @param next called as next (j) to read the next image, returns false at the end
+/// @param done called as done (j) with each denoised image
+/// @param ordered call done () in the order that the images were read
+///
+/// Each worker reads an image, denoises it, and hands it to done ().
+/// Reads are serialized, and so are calls to done () if the output is
+/// ordered, so a worker holds at most one image at a time.
+template<typename F,typename G>
+void serve (const multi_codec<PASSES> &c, F next, G done, bool ordered)
+{
+    mutex read_mutex;
+    mutex done_mutex;
+    condition_variable turn;
+    size_t reads = 0;
+    size_t writes = 0;
+    bool eof = false;
+    string failure;
+    server_stats stats;
+#pragma omp parallel
+    {
+        for (;;)
+        {
+            job j;
+            size_t n;
+            {
+                lock_guard<mutex> lock (read_mutex);
+                if (eof)
+                    break;
+                j.t.tic ();
+                try
+                {
+                    eof = !next (j);
+                }
+                catch (const exception &e)
+                {
+                    lock_guard<mutex> lock (done_mutex);
+                    failure = e.what ();
+                    eof = true;
+                }
+                if (eof)
+                    break;
+                n = reads++;
+            }
+            string error;
+            try
+            {
+                j.p = c.denoise (j.p);
+            }
+            catch (const exception &e)
+            {
+                error = e.what ();
+            }
+            unique_lock<mutex> lock (done_mutex);
+            if (ordered)
+                turn.wait (lock, [&] { return writes == n; });
+            if (error.empty () && failure.empty ())
+            {
+                try
+                {
+                    if (!ordered)
+                        lock.unlock ();
+                    done (j);
+                    if (!ordered)
+                        lock.lock ();
+                    stats.add (j, j.t.toc ());
+                }
+                catch (const exception &e)
+                {
+                    if (!lock.owns_lock ())
+                        lock.lock ();
+                    error = e.what ();
+                }
+            }
+            if (!error.empty () && failure.empty ())
+                failure = j.name + ": " + error;
+            ++writes;
+            turn.notify_all ();
+        }
+    }
+    if (!failure.empty ())
+        throw runtime_error (failure);
+    stats.report (clog);
+}
 
 int main (int argc, char **argv)
 {
     try
     {
-        if (argc != 2)
+        if (argc != 2 && argc != 3)
             throw runtime_error (usage);
 
-        // read codec
-        clog << "reading " << argv[1] << endl;
-        ifstream ifs (argv[1]);
-
-        if (!ifs)
-            throw runtime_error ("Could not read lut");
-
+        // map codec
+        clog << "mapping " << argv[1] << endl;
         multi_codec<PASSES> c;
-        ifs >> c;
+        c.map (argv[1]);
+
+        if (argc == 3)
+        {
+            const string mode (argv[2]);
+            if (mode == "--list")
+            {
+                // input and output file name pairs
+                const vector<string> fns = readwords<string> (cin);
+                if (fns.size () % 2)
+                    throw runtime_error ("you must supply an even number of file names");
+                size_t n = 0;
+                serve (c, [&] (job &j)
+                {
+                    if (n == fns.size ())
+                        return false;
+                    j.name = fns[n++];
+                    j.output = fns[n++];
+                    j.p = read_grayscale (j.name.c_str ());
+                    return true;
+                },
+                [] (const job &j)
+                {
+                    ofstream ofs (j.output.c_str ());
+                    if (!ofs)
+                        throw runtime_error ("could not open file for writing");
+                    write_pnm (ofs, j.p.cols (), j.p.rows (), j.p);
+                }, false);
+            }
+            else if (mode == "--stream")
+            {
+                // concatenated pgms in, concatenated pgms out, in order
+                size_t n = 0;
+                serve (c, [&] (job &j)
+                {
+                    if ((cin >> ws).peek () == EOF)
+                        return false;
+                    j.name = to_string (n++);
+                    j.p = read_grayscale (cin);
+                    if (!cin)
+                        throw runtime_error ("truncated image");
+                    return true;
+                },
+                [] (const job &j)
+                {
+                    write_pnm (cout, j.p.cols (), j.p.rows (), j.p);
+                    cout.flush ();
+                }, true);
+            }
+            else if (mode == "--rows")
+                denoise_rows (c, cin, cout);
+            else
+                throw runtime_error (usage);
+            return 0;
+        }
 
         // read image
         image_t p = read_grayscale (cin);
 
-        const unsigned BORDER = 32;
-        p = mborder<subregion> (p, BORDER);
-
         image_t q = c.denoise (p);
 
-        // crop borders
-        q = crop (q, BORDER);
-
         // save the fixed image
         clog << "writing image" << endl;
         write_pnm (cout, q.cols (), q.rows (), q);
@@ -9,150 +9,360 @@
 
 #include "horny_toad.h"
 #include "jack_rabbit.h"
+#include "lookup.h"
+#include "lut_file.h"
+#include <algorithm>
+#include <cstdint>
 #include <fstream>
+#include <limits>
+#include <omp.h>
+#include <unordered_map>
+#include <vector>
 
 namespace opp
 {
+    /// @brief kernels at least this wide are blurred with FFTs when
+    /// the image is not rescaled
+    ///
+    /// Measured with FFTW 3.3 on a 540x420 page, with the first call's
+    /// planning included: the two are even at 31, and at 41 the FFTs
+    /// are about 1.5 times faster.
+    const size_t GAUSSIAN_BLUR_FFT_KERNEL = 33;
+
     /// @brief gaussian blur and rescale an image
     ///
     /// @tparam T image type
     /// @param p image
-    /// @param kernel size of kernel in pixels
+    /// @param kernel size of kernel in pixels, which must be smaller than the image
     /// @param stddev standard deviation of gaussian kernel
     /// @param scale downsampling scale
     ///
     /// @return the blurred and rescaled image
+    ///
+    /// The gaussian is separable, so the rows are blurred at the output
+    /// columns, and then the columns are blurred at the output rows.
+    /// That is O(kernel) per output pixel instead of O(kernel^2).  The
+    /// image is mirrored about its edges, and the mirrored index of
+    /// every tap is worked out once up front.
+    ///
+    /// Wide kernels at full scale go through FFTs instead, because
+    /// then every pixel is needed and the separable blur is O(kernel).
     template<typename T>
     T gaussian_blur (const T &p, size_t kernel, double stddev, size_t scale)
     {
         const size_t ROWS = p.rows () / scale;
         const size_t COLS = p.cols () / scale;
         T q (ROWS, COLS);
-        // create gaussian kernel
-        jack_rabbit::raster<double> g (kernel, kernel, 1.0);
+        if (q.empty ())
+            return q;
+        assert (kernel < p.rows ());
+        assert (kernel < p.cols ());
+        // create a 1D gaussian kernel
+        jack_rabbit::raster<double> g (1, kernel, 1.0);
         jack_rabbit::subscript_unary_function<double,horny_toad::gaussian_window> f (g.rows (), g.cols ());
         f.stddev (stddev);
         std::transform (g.begin (), g.end (), g.begin (), f);
-        //horny_toad::print2d (std::clog, g);
-        // note that you can't divide by 1/(2*pi*stddev^2) because the tails are
-        // clipped, and the kernel therefore won't sum to 1.0
-        double sum = accumulate (g.begin (), g.end (), 0.0);
+        // the tails are clipped, so normalize it by its sum
+        const double sum = accumulate (g.begin (), g.end (), 0.0);
         for (size_t i = 0; i < g.size (); ++i)
             g[i] /= sum;
-        // blur and downsample at each point
-        for (size_t i = 0; i < ROWS; ++i)
+        // the mirrored index of each tap of each output row or column
+        auto taps = [&] (size_t m, size_t n)
+        {
+            std::vector<size_t> x (m * kernel);
+            for (size_t i = 0; i < m; ++i)
+                for (size_t k = 0; k < kernel; ++k)
+                    x[i * kernel + k] = horny_toad::reflect (int (i * scale + k) - int (kernel - 1) / 2, n - 1);
+            return x;
+        };
+        if (scale == 1 && kernel >= GAUSSIAN_BLUR_FFT_KERNEL)
+        {
+            // pad the image with its mirror image, so that the valid
+            // part of the correlation is the blurred image
+            const size_t pad = (kernel - 1) / 2;
+            jack_rabbit::raster<double> m (ROWS + kernel - 1, COLS + kernel - 1);
+            for (size_t i = 0; i < m.rows (); ++i)
+            {
+                const size_t ii = horny_toad::reflect (int (i) - int (pad), p.rows () - 1);
+                for (size_t j = 0; j < m.cols (); ++j)
+                    m (i, j) = p (ii, horny_toad::reflect (int (j) - int (pad), p.cols () - 1));
+            }
+            jack_rabbit::raster<double> g2 (kernel, kernel);
+            for (size_t i = 0; i < kernel; ++i)
+                for (size_t j = 0; j < kernel; ++j)
+                    g2 (i, j) = g[i] * g[j];
+            const jack_rabbit::raster<double> b = horny_toad::fft_correlate (m, g2);
+            assert (b.rows () == ROWS && b.cols () == COLS);
+            for (size_t i = 0; i < q.size (); ++i)
+                q[i] = b[i];
+            return q;
+        }
+        const std::vector<size_t> ri = taps (ROWS, p.rows ());
+        const std::vector<size_t> ci = taps (COLS, p.cols ());
+        // blur only the rows that the output needs
+        std::vector<bool> needed (p.rows ());
+        for (auto i : ri)
+            needed[i] = true;
+        jack_rabbit::raster<double> r (p.rows (), COLS);
+        for (size_t i = 0; i < p.rows (); ++i)
         {
-            unsigned i2 = i * scale;
+            if (!needed[i])
+                continue;
             for (size_t j = 0; j < COLS; ++j)
             {
-                unsigned j2 = j * scale;
-                assert (i < q.rows ());
-                assert (j < q.cols ());
-                assert (i2 < p.rows ());
-                assert (j2 < p.cols ());
-                q (i, j) = horny_toad::mirrored_dot_product (g, p, i2 - (kernel - 1) / 2, j2 - (kernel - 1) / 2);
+                const size_t *x = &ci[j * kernel];
+                double s = 0.0;
+                for (size_t k = 0; k < kernel; ++k)
+                    s += g[k] * p (i, x[k]);
+                r (i, j) = s;
             }
         }
+        // blur down the columns a row at a time
+        std::vector<double> s (COLS);
+        for (size_t i = 0; i < ROWS; ++i)
+        {
+            std::fill (s.begin (), s.end (), 0.0);
+            const size_t *x = &ri[i * kernel];
+            for (size_t k = 0; k < kernel; ++k)
+            {
+                const double w = g[k];
+                const double *t = &r (x[k], 0);
+                for (size_t j = 0; j < COLS; ++j)
+                    s[j] += w * t[j];
+            }
+            for (size_t j = 0; j < COLS; ++j)
+                q (i, j) = s[j];
+        }
         return q;
     }
 
-    size_t index888 (unsigned a, unsigned b, unsigned c)
-    {
-        return (a << 16) + (b << 8) + c;
-    }
-
     /// @brief single moment lookup table
     ///
+    /// Only contexts that have actually been observed are stored.  The
+    /// table is an open addressed hash keyed on the context index, so
+    /// an unobserved context simply has a zero total and a zero sum.
+    ///
+    /// Totals and sums are kept in counters of type C.  A context whose
+    /// counts would overflow them is promoted: its slot is marked, and
+    /// its counts move to a small map of 64 bit counters.  Narrow
+    /// counters make the table smaller and cheaper to sweep, and hot
+    /// contexts still count exactly.
+    ///
+    /// The table is not thread safe.  Accumulate into a private table
+    /// and merge () it into a shared one under a lock.
+    ///
     /// @tparam T value type of whatever lut is summing
-    template<typename T=size_t>
+    /// @tparam C unsigned counter type
+    template<typename T=size_t,typename C=uint32_t>
     class lut1
     {
+        static_assert (std::numeric_limits<C>::is_integer && !std::numeric_limits<C>::is_signed,
+            "counters must be unsigned");
         public:
-        lut1 (size_t SZ = 0)
-            : totals (SZ)
-            , sums (SZ)
+        /// @brief an empty table
+        ///
+        /// Nothing is allocated until the first context is added, so
+        /// luts that are never trained cost nothing.
+        lut1 ()
+            : n (0)
+            , bits (0)
         { }
+        /// @brief number of observed contexts
         size_t size () const
         {
-            return totals.size ();
+            return n;
         }
-        void resize (size_t n)
+        /// @brief number of contexts whose counts outgrew C
+        size_t promoted () const
         {
-            totals.resize (n);
-            sums.resize (n);
+            return hot.size ();
         }
         void update (size_t i, T x)
         {
-            assert (i < totals.size ());
-            assert (i < sums.size ());
-#pragma omp atomic
-            ++totals[i];
-#pragma omp atomic
-            sums[i] += x;
+            add (i, 1, x);
         }
         void update (size_t i, T x, T count)
         {
-            assert (i < totals.size ());
-            assert (i < sums.size ());
-#pragma omp atomic
-            totals[i] += count;
-#pragma omp atomic
-            sums[i] += x * count;
+            add (i, count, x * count);
+        }
+        /// @brief make room for count contexts
+        void reserve (size_t count)
+        {
+            while (2 * count > keys.size ())
+                grow ();
+        }
+        /// @brief add all of the entries in another lut to this one
+        template<typename D>
+        void merge (const lut1<T,D> &l)
+        {
+            // inserting in another table's slot order into a smaller
+            // table clusters the probes, so make room up front
+            reserve (n + l.size ());
+            l.for_each ([&] (size_t i, uint64_t total, uint64_t sum)
+            {
+                add (i, total, sum);
+            });
+        }
+        /// @brief call f (i, total, sum) for every observed context
+        template<typename F>
+        void for_each (F f) const
+        {
+            for (size_t k = 0; k < keys.size (); ++k)
+            {
+                if (keys[k] == EMPTY)
+                    continue;
+                if (totals[k] == PROMOTED)
+                {
+                    const counts &h = hot.find (keys[k])->second;
+                    f (keys[k], h.first, h.second);
+                }
+                else
+                    f (keys[k], totals[k], sums[k]);
+            }
         }
         T sum (size_t i) const
         {
-            assert (i < sums.size ());
-            return sums[i];
+            if (n == 0)
+                return 0;
+            const size_t k = find (i);
+            if (keys[k] == EMPTY)
+                return 0;
+            return totals[k] == PROMOTED ? hot.find (i)->second.second : sums[k];
         }
         size_t total (size_t i) const
         {
-            assert (i < totals.size ());
-            return totals[i];
+            if (n == 0)
+                return 0;
+            const size_t k = find (i);
+            if (keys[k] == EMPTY)
+                return 0;
+            return totals[k] == PROMOTED ? hot.find (i)->second.first : totals[k];
         }
-        std::ostream& write (std::ostream &s) const
+        /// @brief get the observed contexts as arrays sorted by key
+        ///
+        /// @param k keys
+        /// @param t totals
+        /// @param x sums
+        void sorted (std::vector<uint32_t> &k, std::vector<uint64_t> &t, std::vector<uint64_t> &x) const
         {
-            // not portable
-            s.write (reinterpret_cast<const char *> (&totals[0]), totals.size () * sizeof (size_t));
-            s.write (reinterpret_cast<const char *> (&sums[0]), sums.size () * sizeof (T));
-            return s;
+            k.clear ();
+            k.reserve (n);
+            for (size_t i = 0; i < keys.size (); ++i)
+                if (keys[i] != EMPTY)
+                    k.push_back (keys[i]);
+            std::sort (k.begin (), k.end ());
+            t.resize (n);
+            x.resize (n);
+            for (size_t i = 0; i < n; ++i)
+            {
+                t[i] = total (k[i]);
+                x[i] = sum (k[i]);
+            }
         }
-        std::istream& read (std::istream &s)
+        /// @brief replace the contents of the table
+        ///
+        /// @param k keys
+        /// @param t totals
+        /// @param x sums
+        /// @param count number of contexts
+        void assign (const uint32_t *k, const uint64_t *t, const uint64_t *x, size_t count)
         {
-            // not portable
-            s.read (reinterpret_cast<char *> (&totals[0]), totals.size () * sizeof (size_t));
-            s.read (reinterpret_cast<char *> (&sums[0]), sums.size () * sizeof (T));
-            return s;
+            *this = lut1 ();
+            reserve (count);
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (k[i] == EMPTY)
+                    throw std::runtime_error ("invalid context");
+                add (k[i], t[i], x[i]);
+            }
         }
         private:
-        std::vector<size_t> totals;
-        std::vector<T> sums;
+        static const uint32_t EMPTY = ~0u;
+        static const size_t MIN_BITS = 10;
+        /// @brief total of a promoted slot
+        static const C PROMOTED = std::numeric_limits<C>::max ();
+        typedef std::pair<uint64_t,uint64_t> counts;
+        /// @brief add counts to a context
+        void add (size_t i, uint64_t t, uint64_t x)
+        {
+            const size_t k = insert (i);
+            if (totals[k] != PROMOTED)
+            {
+                // the total must stay below the marker
+                if (t < uint64_t (PROMOTED - totals[k]) && x <= uint64_t (PROMOTED - sums[k]))
+                {
+                    totals[k] += t;
+                    sums[k] += x;
+                    return;
+                }
+                hot[i] = counts (totals[k], sums[k]);
+                totals[k] = PROMOTED;
+                sums[k] = 0;
+            }
+            counts &h = hot[i];
+            h.first += t;
+            h.second += x;
+        }
+        /// @brief get the slot that holds key i, or the empty slot where it belongs
+        size_t find (size_t i) const
+        {
+            assert (i < EMPTY);
+            assert (!keys.empty ());
+            const size_t mask = keys.size () - 1;
+            // fibonacci hashing spreads out neighboring contexts
+            size_t k = (i * 0x9E3779B97F4A7C15ull) >> (64 - bits);
+            while (keys[k] != EMPTY && keys[k] != i)
+                k = (k + 1) & mask;
+            return k;
+        }
+        /// @brief get the slot that holds key i, adding it if needed
+        size_t insert (size_t i)
+        {
+            if (keys.empty ())
+                grow ();
+            size_t k = find (i);
+            if (keys[k] != EMPTY)
+                return k;
+            // keep the load factor under 1/2
+            if (2 * (n + 1) > keys.size ())
+            {
+                grow ();
+                k = find (i);
+            }
+            keys[k] = i;
+            ++n;
+            return k;
+        }
+        void grow ()
+        {
+            bits = keys.empty () ? MIN_BITS : bits + 1;
+            std::vector<uint32_t> k (size_t (1) << bits, EMPTY);
+            std::vector<C> t (k.size ());
+            std::vector<C> x (k.size ());
+            k.swap (keys);
+            t.swap (totals);
+            x.swap (sums);
+            for (size_t i = 0; i < k.size (); ++i)
+            {
+                if (k[i] == EMPTY)
+                    continue;
+                const size_t m = find (k[i]);
+                keys[m] = k[i];
+                totals[m] = t[i];
+                sums[m] = x[i];
+            }
+        }
+        size_t n;
+        size_t bits;
+        std::vector<uint32_t> keys;
+        std::vector<C> totals;
+        std::vector<C> sums;
+        std::unordered_map<uint32_t,counts> hot;
     };
 
-    /// @brief helper I/O function for lut1<T>
-    ///
-    /// @tparam T
-    /// @param s stream
-    /// @param l lut
-    ///
-    /// @return istream
-    template<typename T>
-    std::istream& operator>> (std::istream &s, lut1<T> &l)
-    {
-        return l.read (s);
-    }
-
-    /// @brief helper I/O function for lut1<T>
-    ///
-    /// @tparam T
-    /// @param s stream
-    /// @param l lut
-    ///
-    /// @return ostream
-    template<typename T>
-    std::ostream& operator<< (std::ostream &s, const lut1<T> &l)
-    {
-        return l.write (s);
-    }
+    template<typename T,typename C> const uint32_t lut1<T,C>::EMPTY;
+    template<typename T,typename C> const size_t lut1<T,C>::MIN_BITS;
+    template<typename T,typename C> const C lut1<T,C>::PROMOTED;
 };
 
 namespace denoise
@@ -181,40 +391,216 @@ T avg (const T &a, const T &b)
     return c;
 }
 
-class context
+/// @brief one pixel of a context
+///
+/// @tparam DI row offset from the pixel being denoised
+/// @tparam DJ column offset
+/// @tparam BITS number of bits the pixel is quantized to
+///
+/// The offsets describe the horizontal orientation of a context.  The
+/// vertical orientation is the same shape rotated by 90 degrees, so
+/// the tap at (DI, DJ) moves to (DJ, -DI).
+template<int DI,int DJ,unsigned BITS=8>
+struct tap
+{
+    static_assert (DI >= -1 && DI <= 1 && DJ >= -1 && DJ <= 1, "taps must be within one pixel");
+    static_assert (BITS >= 1 && BITS <= 8, "taps are 1 to 8 bits");
+    static const int di = DI;
+    static const int dj = DJ;
+    static const unsigned bits = BITS;
+    /// @brief get the pixels of this tap for a run starting at column j
+    ///
+    /// @param r the rows above, at and below the pixels
+    /// @param j column
+    /// @param h horizontal or vertical orientation
+    /// @param m mirror the tap across the axis of the orientation
+    static const unsigned char *row (const unsigned char *const *r, size_t j, bool h, bool m = false)
+    {
+        if (m)
+            return h ? r[1 + DI] + j - DJ : r[1 - DJ] + j - DI;
+        return h ? r[1 + DI] + j + DJ : r[1 + DJ] + j - DI;
+    }
+};
+
+/// @brief compile time list of taps
+template<typename... T>
+struct taps;
+
+template<>
+struct taps<>
+{
+    static const unsigned bits = 0;
+    static const int center_shift = -1;
+    static const unsigned center_bits = 0;
+    static const bool flat = true;
+    static void index (const unsigned char *const *, size_t, size_t, bool, bool, uint32_t *)
+    {
+    }
+    static void hash (uint32_t &)
+    {
+    }
+};
+
+template<typename T,typename... U>
+struct taps<T,U...>
 {
+    static const unsigned bits = T::bits + taps<U...>::bits;
+    static const bool is_center = T::di == 0 && T::dj == 0;
+    /// @brief position of the centre tap in an index
+    static const int center_shift = is_center ? int (taps<U...>::bits) : taps<U...>::center_shift;
+    static const unsigned center_bits = is_center ? T::bits : taps<U...>::center_bits;
+    /// @brief whether every tap is in the row of the centre pixel
+    static const bool flat = T::di == 0 && taps<U...>::flat;
+    /// @brief shift each tap into a run of indexes, first tap first
+    static void index (const unsigned char *const *r, size_t j0, size_t j1, bool h, bool m, uint32_t *idx)
+    {
+        // one tap at a time, so that the loop vectorizes
+        const unsigned char *p = T::row (r, j0, h, m);
+        for (size_t j = 0; j < j1 - j0; ++j)
+            idx[j] = (idx[j] << T::bits) | (p[j] >> (8 - T::bits));
+        taps<U...>::index (r, j0, j1, h, m, idx);
+    }
+    static void hash (uint32_t &h)
+    {
+        const int x[3] = { T::di, T::dj, int (T::bits) };
+        for (int k = 0; k < 3; ++k)
+            h = (h ^ uint32_t (x[k])) * 16777619u;
+        taps<U...>::hash (h);
+    }
+};
+
+/// @brief look up the outputs of a run of pixels in a dense table
+template<typename... T>
+struct shape_lookup
+{
+    static void lookup (const unsigned char *const *r, size_t j0, size_t j1, bool h,
+        const unsigned char *t, unsigned char *q)
+    {
+        // a chunk at a time, so that the indexes stay in L1
+        const size_t CHUNK = 256;
+        uint32_t idx[CHUNK];
+        for (size_t j = j0; j < j1; j += CHUNK)
+        {
+            const size_t n = std::min (CHUNK, j1 - j);
+            std::fill (idx, idx + n, 0);
+            taps<T...>::index (r, j, j + n, h, false, idx);
+            for (size_t k = 0; k < n; ++k)
+                q[j + k] = t[idx[k]];
+        }
+    }
+};
+
+/// @brief three full precision taps can use the vectorized lookups
+template<int A,int B,int C,int D,int E,int F>
+struct shape_lookup<tap<A,B>,tap<C,D>,tap<E,F>>
+{
+    static void lookup (const unsigned char *const *r, size_t j0, size_t j1, bool h,
+        const unsigned char *t, unsigned char *q)
+    {
+        opp::lookup888 (tap<A,B>::row (r, j0, h), tap<C,D>::row (r, j0, h), tap<E,F>::row (r, j0, h),
+            q + j0, j1 - j0, t);
+    }
+};
+
+/// @brief a context made from a list of taps
+///
+/// The index of a context is the concatenation of its quantized taps,
+/// the first tap in the most significant bits.  Every context has a
+/// full precision centre tap, which is what unseen contexts map to.
+///
+/// @tparam T the taps
+template<typename... T>
+class context_shape
+{
+    typedef taps<T...> taps_t;
+    static_assert (taps_t::center_shift >= 0, "a context must contain its centre pixel");
+    static_assert (taps_t::center_bits == 8, "the centre tap must be full precision");
+    static_assert (taps_t::bits < 32, "context indexes must fit in 31 bits");
     public:
-    static size_t indexh (const image_t &p, size_t i, size_t j)
+    /// @brief get the contexts of a run of pixels in a row
+    ///
+    /// @param r the rows above, at and below the pixels
+    /// @param j0 first column
+    /// @param j1 one past the last column
+    /// @param h horizontal or vertical context
+    /// @param idx indexes, idx[j - j0] is set for every column j
+    static void index (const unsigned char *const *r, size_t j0, size_t j1, bool h, uint32_t *idx)
     {
-        assert (i >= 0);
-        assert (j >= 1);
-        assert (i < p.rows ());
-        assert (j + 1 < p.cols ());
-        return opp::index888 (p (i, j - 1), p (i, j), p (i, j + 1));
+        std::fill (idx, idx + (j1 - j0), 0);
+        taps_t::index (r, j0, j1, h, false, idx);
     }
-    static size_t indexv (const image_t &p, size_t i, size_t j)
+    /// @brief get the contexts of a run of pixels as seen in a mirror image
+    ///
+    /// This is the context that the pixel would have if the image were
+    /// flipped across the axis of the orientation, so (a, b, c) becomes
+    /// (c, b, a) for the 1x3 context.
+    static void mirrored_index (const unsigned char *const *r, size_t j0, size_t j1, bool h, uint32_t *idx)
     {
-        assert (i >= 1);
-        assert (j >= 0);
-        assert (i + 1 < p.rows ());
-        assert (j < p.cols ());
-        return opp::index888 (p (i - 1, j), p (i, j), p (i + 1, j));
+        std::fill (idx, idx + (j1 - j0), 0);
+        taps_t::index (r, j0, j1, h, true, idx);
+    }
+    /// @brief look up the outputs of a run of pixels in a row
+    ///
+    /// @param r the rows above, at and below the pixels
+    /// @param j0 first column
+    /// @param j1 one past the last column
+    /// @param h horizontal or vertical context
+    /// @param t dense output table, preceded by at least 3 readable bytes
+    /// @param q output row, q[j] is set for every column j
+    static void lookup (const unsigned char *const *r, size_t j0, size_t j1, bool h,
+        const unsigned char *t, unsigned char *q)
+    {
+        shape_lookup<T...>::lookup (r, j0, j1, h, t, q);
     }
     static size_t kernel_size ()
     {
         return 3;
     }
-    static opp::lut1<size_t> default_lut (size_t count)
+    /// @brief whether mirroring each pass about the image edges is the
+    /// same as mirroring the image once with a wide border
+    ///
+    /// The lut counts every context and its mirrored_index (), so a
+    /// pass commutes with the flip along its orientation.  It only
+    /// commutes with the flip across its orientation when every tap
+    /// lies in the centre pixel's row, as in the 1x3 context.
+    static bool mirrors_exactly ()
+    {
+        return taps_t::flat;
+    }
+    /// @brief number of bits in a context index
+    static size_t bits ()
     {
-        opp::lut1<size_t> l (1 << 24);
-        for (size_t a = 0; a < 256; ++a)
-        for (size_t b = 0; b < 256; ++b)
-        for (size_t c = 0; c < 256; ++c)
-            l.update (opp::index888 (a, b, c), b, count);
-        return l;
+        return taps_t::bits;
+    }
+    /// @brief identify the shape, so that luts are only used with the shape they were trained with
+    static uint32_t id ()
+    {
+        // fnv-1a of the taps
+        uint32_t h = 2166136261u;
+        taps_t::hash (h);
+        return h;
+    }
+    /// @brief get the centre pixel of a context
+    ///
+    /// Contexts that were never observed during training map to their
+    /// centre pixel.
+    static unsigned center (size_t n)
+    {
+        return (n >> taps_t::center_shift) & 0xFF;
     }
 };
 
+/// @brief three pixels in a row
+typedef context_shape<tap<0,-1>,tap<0,0>,tap<0,1>> context;
+/// @brief three pixels on a diagonal
+typedef context_shape<tap<-1,-1>,tap<0,0>,tap<1,1>> context_diagonal;
+/// @brief the pixel and its neighbours to the right, below, and below right
+typedef context_shape<tap<0,0>,tap<0,1,5>,tap<1,0,5>,tap<1,1,5>> context_2x2;
+/// @brief the pixel and its four nearest neighbours
+///
+/// At 28 bits, this one is stored sparsely.
+typedef context_shape<tap<-1,0,5>,tap<0,-1,5>,tap<0,0>,tap<0,1,5>,tap<1,0,5>> context_plus;
+
 template<typename T>
 const T rescale (const T &p, const double scale)
 {
@@ -238,72 +624,478 @@ class codec
 {
     private:
     opp::lut1<size_t> l;
+    static const size_t TABLE_PAD = 8;
+    std::vector<unsigned char> t;
+    const unsigned char *out;
+    size_t out_size;
+    opp::sparse_table st;
+    std::vector<unsigned char> hot_bytes;
+    opp::sparse_table ht;
     public:
+    /// @brief contexts with more bits than this are stored sparsely
+    static const size_t DENSE_BITS = 24;
     codec ()
-        : l (C::default_lut (1))
+        : out (0)
+        , out_size (0)
     {
     }
+    /// @brief the output tables point into the codec's own buffers or
+    /// into a mapped file, so a copy would dangle
+    codec (const codec &) = delete;
+    codec &operator= (const codec &) = delete;
+    /// @brief check if the output table is a sparse_table
+    static bool sparse ()
+    {
+        return C::bits () > DENSE_BITS;
+    }
+    const opp::lut1<size_t> &lut () const
+    {
+        return l;
+    }
+    opp::lut1<size_t> &lut ()
+    {
+        return l;
+    }
+    /// @brief the output table
+    ///
+    /// This is either the output value for every context, or a
+    /// sparse_table of the observed contexts.
+    ///
+    /// @return the table, or 0 if the codec has not been finalized
+    const unsigned char *table () const
+    {
+        return out;
+    }
+    /// @brief size of the output table in bytes
+    size_t table_size () const
+    {
+        return out_size;
+    }
+    /// @brief size of a dense output table in bytes
+    static size_t dense_table_size ()
+    {
+        return size_t (1) << C::bits ();
+    }
+    /// @brief get the output value of a context from its counts
+    ///
+    /// Every context starts out with a single observation of its
+    /// centre pixel, so unseen contexts are left unchanged.
+    static unsigned char output (size_t n, size_t total, size_t sum)
+    {
+        const double x = static_cast<double> (sum + C::center (n)) / (total + 1);
+        assert (x >= 0.0);
+        assert (x <= 255.0);
+        return round (x);
+    }
+    /// @brief collapse the lut into a single output value per context
+    ///
+    /// Denoising only looks at this table, so this must be called
+    /// after the codec has been trained.
+    void finalize ()
+    {
+        hot (opp::lut1<size_t> (), 0);
+        if (sparse ())
+        {
+            std::vector<uint32_t> k;
+            std::vector<unsigned char> v;
+            k.reserve (l.size ());
+            v.reserve (l.size ());
+            l.for_each ([&] (size_t n, size_t total, size_t sum)
+            {
+                k.push_back (n);
+                v.push_back (output (n, total, sum));
+            });
+            out_size = opp::sparse_table::bytes (k.size ());
+            t.resize (TABLE_PAD + out_size);
+            opp::sparse_table::build (k.data (), v.data (), k.size (), &t[TABLE_PAD]);
+            out = &t[TABLE_PAD];
+            st = opp::sparse_table (out, out_size);
+            return;
+        }
+        // the vectorized lookups read up to 3 bytes before an entry
+        out_size = dense_table_size ();
+        t.resize (TABLE_PAD + out_size);
+        unsigned char *u = &t[TABLE_PAD];
+        for (size_t n = 0; n < out_size; ++n)
+            u[n] = C::center (n);
+        l.for_each ([&] (size_t n, size_t total, size_t sum)
+        {
+            u[n] = output (n, total, sum);
+        });
+        out = u;
+    }
+    /// @brief use a finalized table that lives somewhere else
+    ///
+    /// @param m table that was built by finalize (), 8 byte aligned
+    /// and preceded by at least 3 readable bytes
+    /// @param sz size of the table in bytes
+    void map (const unsigned char *m, size_t sz)
+    {
+        if (sparse ())
+            st = opp::sparse_table (m, sz);
+        else if (sz != dense_table_size ())
+            throw std::runtime_error ("lut file has the wrong table size");
+        std::vector<unsigned char> ().swap (t);
+        out = m;
+        out_size = sz;
+        hot (opp::lut1<size_t> (), 0);
+    }
+    /// @brief use a copy of a finalized table
+    ///
+    /// @param m table that was built by finalize ()
+    /// @param sz size of the table in bytes
+    void load (const unsigned char *m, size_t sz)
+    {
+        std::vector<unsigned char> u (TABLE_PAD + sz);
+        std::copy (m, m + sz, u.begin () + TABLE_PAD);
+        map (&u[TABLE_PAD], sz);
+        t.swap (u);
+    }
     void update (const image_t &p, const image_t &q, const bool h)
     {
-        update2 (p, q, h);
-        if (h)
-            update2 (horny_toad::fliplr (p), horny_toad::fliplr (q), h);
-        else
-            update2 (horny_toad::flipud (p), horny_toad::flipud (q), h);
+        // accumulate privately so that images can be trained concurrently
+        opp::lut1<size_t> t;
+        update (t, p, q, h);
+#pragma omp critical (codec_update)
+        merge (t);
     }
-    void update2 (const image_t &p, const image_t &q, const bool h)
+    /// @brief accumulate counts into a table owned by the caller
+    ///
+    /// Each worker can keep its own table across many images and
+    /// merge () it once at the end of the pass.
+    ///
+    /// Every context is also counted mirrored, which is the same as
+    /// training on the flipped image as well.
+    template<typename L>
+    static void update (L &l, const image_t &p, const image_t &q, const bool h)
     {
-        const size_t K = C::kernel_size ();
-        if (h)
+        update2 (l, p, q, h);
+    }
+    void merge (const opp::lut1<size_t> &t)
+    {
+        l.merge (t);
+    }
+    /// @brief count how often each context of an image gets looked up
+    ///
+    /// @param hits the count of each context is its total
+    /// @param p the image
+    /// @param h horizontal or vertical pass
+    ///
+    /// Only the interior of the image is counted.
+    static void profile (opp::lut1<size_t> &hits, const image_t &p, const bool h)
+    {
+        if (p.cols () <= 2)
+            return;
+        std::vector<uint32_t> idx (p.cols ());
+        for (size_t i = 1; i + 1 < p.rows (); ++i)
         {
-            for (size_t i = K; i + K < p.rows (); ++i)
-                for (size_t j = K; j + K < p.cols (); ++j)
-                    l.update (C::indexh (q, i, j), p (i, j));
+            const unsigned char *r[3] = { &p (i - 1, 0), &p (i, 0), &p (i + 1, 0) };
+            C::index (r, 1, p.cols () - 1, h, &idx[0]);
+            for (size_t j = 0; j + 2 < p.cols (); ++j)
+                hits.update (idx[j], 0);
         }
-        else
+    }
+    /// @brief keep the outputs of the most used contexts in a small table
+    ///
+    /// @param hits the count of each context is its total, from
+    /// profile (), or the lut of a trained codec
+    /// @param k number of contexts to keep, or 0 for no hot table
+    ///
+    /// The hot table is searched first, and the full table is only
+    /// read when a context is not in it.  Pages of text hit a handful
+    /// of contexts most of the time, so a few thousand of them can
+    /// stay in cache.  The search costs more than a read of a dense
+    /// table though, so bench hot measures whether it pays.
+    /// Finalizing or mapping a table drops its hot table.
+    void hot (const opp::lut1<size_t> &hits, size_t k)
+    {
+        std::vector<unsigned char> ().swap (hot_bytes);
+        ht = opp::sparse_table ();
+        if (k == 0 || hits.size () == 0)
+            return;
+        assert (out);
+        std::vector<std::pair<uint64_t,uint32_t>> h;
+        h.reserve (hits.size ());
+        hits.for_each ([&] (size_t i, uint64_t total, uint64_t)
+        {
+            h.push_back (std::make_pair (total, uint32_t (i)));
+        });
+        k = std::min (k, h.size ());
+        std::nth_element (h.begin (), h.begin () + k - 1, h.end (), std::greater<std::pair<uint64_t,uint32_t>> ());
+        std::vector<uint32_t> keys (k);
+        std::vector<unsigned char> values (k);
+        for (size_t n = 0; n < k; ++n)
         {
-            for (size_t i = K; i + K < p.rows (); ++i)
-                for (size_t j = K; j + K < p.cols (); ++j)
-                    l.update (C::indexv (q, i, j), p (i, j));
+            keys[n] = h[n].second;
+            values[n] = value (keys[n]);
         }
+        hot_bytes.resize (opp::sparse_table::bytes (k));
+        opp::sparse_table::build (keys.data (), values.data (), k, hot_bytes.data ());
+        ht = opp::sparse_table (hot_bytes.data (), hot_bytes.size ());
     }
-    image_t denoise (const image_t &p, const bool h) const
+    /// @brief the hot table, which is empty if there isn't one
+    const opp::sparse_table &hot_table () const
     {
-        image_t q (p.rows (), p.cols ());
-        const size_t K = C::kernel_size() / 2; // offset to center
+        return ht;
+    }
+    /// @brief size of the hot table in bytes
+    size_t hot_table_size () const
+    {
+        return hot_bytes.size ();
+    }
+    /// @brief count the contexts of an image and of its mirror image
+    ///
+    /// The pixels that are counted are symmetric about the centre of
+    /// the image, so counting each one's mirrored context gives the
+    /// same counts as sweeping a flipped copy of the image.
+    template<typename L>
+    static void update2 (L &l, const image_t &p, const image_t &q, const bool h)
+    {
+        const size_t K = C::kernel_size ();
+        if (p.cols () <= 2 * K)
+            return;
+        // get a whole row of contexts at once, then count them
+        std::vector<uint32_t> idx (p.cols ());
+        std::vector<uint32_t> mdx (p.cols ());
         for (size_t i = K; i + K < p.rows (); ++i)
         {
+            const unsigned char *r[3] = { &q (i - 1, 0), &q (i, 0), &q (i + 1, 0) };
+            C::index (r, K, p.cols () - K, h, &idx[0]);
+            C::mirrored_index (r, K, p.cols () - K, h, &mdx[0]);
             for (size_t j = K; j + K < p.cols (); ++j)
             {
-                const size_t n = h ? C::indexh (p, i, j) : C::indexv (p, i, j);
-                // luts should have been preloaded
-                assert (l.total (n) != 0);
-                const double x = static_cast<double> (l.sum (n)) / l.total (n);
-                assert (x >= 0.0);
-                assert (x <= 255.0);
-                q (i, j) = round (x);
+                l.update (idx[j - K], p (i, j));
+                l.update (mdx[j - K], p (i, j));
             }
         }
+    }
+    /// @brief denoise an image
+    ///
+    /// @param p the image
+    /// @param h horizontal or vertical pass
+    /// @param mirror mirror the image about its edges, otherwise the
+    /// first and last row and column are set to zero
+    image_t denoise (const image_t &p, const bool h, const bool mirror = false) const
+    {
+        image_t q (p.rows (), p.cols ());
+        for (size_t i = 0; i < p.rows (); ++i)
+        {
+            const bool edge = i == 0 || i + 1 == p.rows ();
+            if (edge && !mirror)
+                continue;
+            const size_t above = i == 0 ? std::min (p.rows () - 1, size_t (1)) : i - 1;
+            const size_t below = i + 1 == p.rows () ? (i == 0 ? 0 : i - 1) : i + 1;
+            const unsigned char *r[3] = { &p (above, 0), &p (i, 0), &p (below, 0) };
+            denoise (r, &q (i, 0), p.cols (), h, mirror);
+        }
         return q;
     }
+    /// @brief denoise a single row
+    ///
+    /// @param r the input rows above, at and below the row
+    /// @param q the output row
+    /// @param cols number of columns
+    /// @param h horizontal or vertical pass
+    /// @param mirror mirror the rows about their ends, otherwise the
+    /// first and last columns are set to zero
+    void denoise (const unsigned char *const *r, unsigned char *q, size_t cols, const bool h, const bool mirror = false) const
+    {
+        // the codec must have been finalized
+        assert (out);
+        // contexts reach one pixel in each direction
+        assert (C::kernel_size () == 3);
+        if (cols == 0)
+            return;
+        if (cols > 2)
+            lookup (r, 1, cols - 1, h, q);
+        if (!mirror)
+        {
+            q[0] = q[cols - 1] = 0;
+            return;
+        }
+        q[0] = edge (r, 0, cols > 1 ? 1 : 0, h);
+        if (cols > 1)
+            q[cols - 1] = edge (r, cols - 1, cols - 2, h);
+    }
     private:
-    friend std::ostream& operator<< (std::ostream &s, const codec &c)
+    /// @brief look up the outputs of a run of pixels in a row
+    void lookup (const unsigned char *const *r, size_t j0, size_t j1, const bool h, unsigned char *q) const
     {
-        s << c.l;
-        return s;
+        if (!sparse () && hot_bytes.empty ())
+        {
+            C::lookup (r, j0, j1, h, out, q);
+            return;
+        }
+        const size_t CHUNK = 256;
+        uint32_t idx[CHUNK];
+        for (size_t j = j0; j < j1; j += CHUNK)
+        {
+            const size_t n = std::min (CHUNK, j1 - j);
+            C::index (r, j, j + n, h, idx);
+            if (hot_bytes.empty ())
+            {
+                for (size_t k = 0; k < n; ++k)
+                    q[j + k] = value (idx[k]);
+                continue;
+            }
+            for (size_t k = 0; k < n; ++k)
+                if (!ht.find (idx[k], q[j + k]))
+                    q[j + k] = value (idx[k]);
+        }
     }
-    friend std::istream& operator>> (std::istream &s, codec &c)
+    /// @brief get the output of a context from the full table
+    unsigned char value (uint32_t i) const
     {
-        s >> c.l;
-        return s;
+        return sparse () ? st.lookup (i, C::center (i)) : out[i];
+    }
+    /// @brief get the output of an end pixel of a row
+    ///
+    /// @param r the input rows above, at and below the row
+    /// @param j the end column
+    /// @param m the column that is mirrored into the one past the end
+    /// @param h horizontal or vertical pass
+    unsigned char edge (const unsigned char *const *r, size_t j, size_t m, const bool h) const
+    {
+        unsigned char e[3][3];
+        for (size_t k = 0; k < 3; ++k)
+        {
+            e[k][0] = e[k][2] = r[k][m];
+            e[k][1] = r[k][j];
+        }
+        const unsigned char *s[3] = { e[0], e[1], e[2] };
+        unsigned char q[3];
+        lookup (s, 1, 2, h, q);
+        return q[1];
     }
 };
 
-template<size_t N>
+/// @brief run all of a multi_codec's passes over a rolling window of rows
+///
+/// Rows of the noisy image are pushed in from the top, and each
+/// denoised row is handed to a sink as soon as every pass has seen the
+/// row below it.  Each pass only keeps the last three rows of its
+/// input, so the working set stays in cache and nothing is allocated
+/// per pass.
+///
+/// Like codec::denoise (), every pass either mirrors the image about
+/// its edges or sets the first and last row and column to zero, so the
+/// output is identical to running the passes one after another on
+/// whole images.
+///
+/// A pipeline can also start part way down an image.  Each pass then
+/// has no output for the first row it sees, so the first N rows that
+/// come out of the last pass are missing, and a band of the image needs
+/// N rows of halo above it.
+///
+/// @tparam C context type
+/// @tparam N number of passes
+template<typename C,size_t N>
+class line_pipeline
+{
+    public:
+    /// @brief constructor
+    ///
+    /// @param c the codecs, one per pass
+    /// @param rows number of rows in the image
+    /// @param cols number of columns in the image
+    /// @param first the first row that will be pushed
+    /// @param mirror mirror the image about its edges instead of zeroing them
+    ///
+    /// The image must not be empty.
+    line_pipeline (const codec<C> *c, size_t rows, size_t cols, size_t first = 0, bool mirror = false)
+        : c (c)
+        , rows (rows)
+        , cols (cols)
+        , mirror (mirror)
+        , next (first)
+    {
+        assert (rows > 0 && cols > 0);
+        for (size_t n = 0; n < N; ++n)
+        {
+            // after the top of the image, each pass starts a row later
+            start[n] = first == 0 ? 0 : first + n;
+            window[n].resize (3 * cols);
+            out[n].resize (cols);
+        }
+    }
+    /// @brief push the next row of the noisy image
+    ///
+    /// @param p the row
+    /// @param sink called as sink (i, row) for every finished row, in order
+    ///
+    /// The row passed to the sink is only valid during the call.
+    template<typename F>
+    void push (const unsigned char *p, F sink)
+    {
+        assert (next < rows);
+        push (0, next++, p, sink);
+    }
+    private:
+    template<typename F>
+    void push (size_t n, size_t i, const unsigned char *p, F &sink)
+    {
+        if (n == N)
+        {
+            sink (i, p);
+            return;
+        }
+        // keep the last three input rows of this pass
+        unsigned char *w = &window[n][0];
+        std::copy (p, p + cols, w + (i % 3) * cols);
+        unsigned char *q = &out[n][0];
+        if (i == 0 && !mirror)
+        {
+            std::fill (q, q + cols, 0);
+            push (n + 1, i, q, sink);
+        }
+        if (i >= start[n] + 2)
+            denoise (n, i - 2, i - 1, i, sink);
+        else if (i == 1 && start[n] == 0 && mirror)
+            denoise (n, 1, 0, 1, sink);
+        if (i + 1 == rows)
+        {
+            if (mirror)
+                denoise (n, i == 0 ? 0 : i - 1, i, i == 0 ? 0 : i - 1, sink);
+            else if (i != 0)
+            {
+                std::fill (q, q + cols, 0);
+                push (n + 1, i, q, sink);
+            }
+        }
+    }
+    /// @brief denoise row i of a pass and push it to the next pass
+    template<typename F>
+    void denoise (size_t n, size_t above, size_t i, size_t below, F &sink)
+    {
+        const unsigned char *w = &window[n][0];
+        const unsigned char *r[3] = {
+            w + (above % 3) * cols,
+            w + (i % 3) * cols,
+            w + (below % 3) * cols };
+        unsigned char *q = &out[n][0];
+        c[n].denoise (r, q, cols, !(n & 1), mirror);
+        push (n + 1, i, q, sink);
+    }
+    const codec<C> *c;
+    const size_t rows;
+    const size_t cols;
+    const bool mirror;
+    size_t next;
+    size_t start[N];
+    std::vector<unsigned char> window[N];
+    std::vector<unsigned char> out[N];
+};
+
+/// @brief a codec for each of N passes
+///
+/// @tparam N number of passes
+/// @tparam C context type
+template<size_t N,typename C=context>
 class multi_codec
 {
     private:
-    codec<context> c[N];
+    codec<C> c[N];
+    opp::mapped_file f;
     public:
     size_t lut_passes () const { return N; }
     void update (const image_t &p, const image_t &q, size_t pass)
@@ -315,24 +1107,333 @@ class multi_codec
         // update using restored image
         c[pass].update (p, t, !(pass & 1));
     }
+    /// @brief accumulate a pass's counts into a table owned by the caller
+    ///
+    /// The table must be merge ()'d before the pass is finalized.
+    void update (const image_t &p, const image_t &q, size_t pass, opp::lut1<size_t> &l) const
+    {
+        image_t t (q);
+        // restore q up to this pass
+        for (size_t n = 0; n < pass; ++n)
+            t = c[n].denoise (t, !(n & 1));
+        // update using restored image
+        codec<C>::update (l, p, t, !(pass & 1));
+    }
+    /// @brief accumulate a pass's counts for an image that has already been restored
+    ///
+    /// @param p clean image
+    /// @param t noisy image restored up to, but not including, this pass
+    /// @param pass the pass
+    /// @param l table owned by the caller
+    ///
+    /// Keeping each image's restored state between passes means that
+    /// a pass costs one denoise () sweep instead of one per earlier pass.
+    void update_restored (const image_t &p, const image_t &t, size_t pass, opp::lut1<size_t> &l) const
+    {
+        codec<C>::update (l, p, t, !(pass & 1));
+    }
+    void merge (size_t pass, const opp::lut1<size_t> &l)
+    {
+        c[pass].merge (l);
+    }
+    /// @brief finalize a pass once it has been trained
+    ///
+    /// A pass must be finalized before the next pass can be trained.
+    void finalize (size_t pass)
+    {
+        c[pass].finalize ();
+    }
+    /// @brief denoise an image
+    ///
+    /// The image is mirrored about its edges, so every pixel is
+    /// denoised.  If C::mirrors_exactly (), each pass mirrors the
+    /// edges itself and no border has to be added.  Other shapes get a
+    /// mirrored border that is cropped off at the end.  Large images are
+    /// split into bands of rows that are denoised in parallel, unless
+    /// the caller is already running in parallel, as the denoise
+    /// server's workers are.
     image_t denoise (const image_t &q) const
     {
-        image_t p (q);
-        for (size_t n = 0; n < N; ++n)
-            p = c[n].denoise (p, !(n & 1));
+        if (q.empty ())
+            return image_t (q.rows (), q.cols ());
+        if (!C::mirrors_exactly ())
+            return horny_toad::crop (denoise_bands (add_border (q), false), BORDER);
+        return denoise_bands (q, true);
+    }
+    /// @brief denoise a batch of images
+    ///
+    /// @param q noisy images
+    ///
+    /// @return the denoised images, in the same order
+    ///
+    /// The bands of all of the images are denoised in a single parallel
+    /// loop.  A batch of small images keeps every core busy without an
+    /// image ever being split more than it has to be, and all the
+    /// workers query the same tables at the same time.
+    images_t denoise (const images_t &q) const
+    {
+        const bool mirror = C::mirrors_exactly ();
+        images_t b;
+        if (!mirror)
+            for (size_t n = 0; n < q.size (); ++n)
+                b.push_back (q[n].empty () ? q[n] : add_border (q[n]));
+        const images_t &in = mirror ? q : b;
+        images_t p (in.size ());
+        // image, first row and one past the last row of each band
+        struct band
+        {
+            size_t n;
+            size_t i0;
+            size_t i1;
+        };
+        std::vector<band> w;
+        // only split images when there are fewer of them than threads
+        const size_t threads = omp_get_max_threads ();
+        const size_t wanted = q.empty () ? 1 : (threads + q.size () - 1) / q.size ();
+        for (size_t n = 0; n < in.size (); ++n)
+        {
+            p[n] = image_t (in[n].rows (), in[n].cols ());
+            if (p[n].empty ())
+                continue;
+            const size_t m = bands (in[n].rows (), wanted);
+            for (size_t k = 0; k < m; ++k)
+                w.push_back (band { n, k * in[n].rows () / m, (k + 1) * in[n].rows () / m });
+        }
+#pragma omp parallel for schedule (dynamic) if (w.size () > 1)
+        for (size_t k = 0; k < w.size (); ++k)
+            denoise (in[w[k].n], p[w[k].n], w[k].i0, w[k].i1, mirror);
+        if (!mirror)
+            for (size_t n = 0; n < p.size (); ++n)
+                if (!p[n].empty ())
+                    p[n] = horny_toad::crop (p[n], BORDER);
+        return p;
+    }
+    /// @brief denoise a band of rows of an image
+    ///
+    /// @param q noisy image
+    /// @param p denoised image, the same size as q
+    /// @param i0 first row of the band
+    /// @param i1 one past the last row of the band
+    ///
+    /// @param mirror mirror the image about its edges instead of zeroing them
+    ///
+    /// Only rows i0 to i1 - 1 of p are written, so bands can be
+    /// denoised concurrently.
+    void denoise (const image_t &q, image_t &p, size_t i0, size_t i1, bool mirror = true) const
+    {
+        assert (p.rows () == q.rows ());
+        assert (p.cols () == q.cols ());
+        assert (i0 <= i1 && i1 <= q.rows ());
+        if (i0 == i1)
+            return;
+        // the passes need N rows of context on either side of the band
+        const size_t first = i0 < N ? 0 : i0 - N;
+        const size_t last = std::min (q.rows (), i1 + N);
+        // run all the passes at once, a few rows at a time
+        line_pipeline<C,N> l (c, q.rows (), q.cols (), first, mirror);
+        for (size_t i = first; i < last; ++i)
+            l.push (&q (i, 0), [&] (size_t i, const unsigned char *r)
+            {
+                if (i >= i0 && i < i1)
+                    std::copy (r, r + p.cols (), &p (i, 0));
+            });
+    }
+    /// @brief denoise an image a row at a time
+    ///
+    /// @param rows number of rows in the image
+    /// @param cols number of columns in the image
+    /// @param source called as source (row) to fill in the next row of
+    /// the noisy image, from the top down
+    /// @param sink called as sink (i, row) with each denoised row, in order
+    ///
+    /// The output is the same as denoise (), but only a few rows per
+    /// pass are kept, so memory does not grow with the height of the
+    /// image.  Each row goes to the sink as soon as it is final.  The
+    /// row passed to the sink is only valid during the call.
+    ///
+    /// A border can't be added to a stream, so every shape is mirrored
+    /// by its passes.  Unless C::mirrors_exactly (), the pixels near
+    /// the edges can differ from denoise ().
+    template<typename F,typename G>
+    void denoise_rows (size_t rows, size_t cols, F source, G sink) const
+    {
+        // an empty image has no rows to read or write
+        if (rows == 0 || cols == 0)
+            return;
+        std::vector<unsigned char> r (cols);
+        line_pipeline<C,N> l (c, rows, cols, 0, true);
+        for (size_t i = 0; i < rows; ++i)
+        {
+            source (r.data ());
+            l.push (r.data (), sink);
+        }
+    }
+    private:
+    /// @brief width of the mirrored border for shapes that don't
+    /// mirror exactly
+    static const size_t BORDER = 32;
+    static image_t add_border (const image_t &q)
+    {
+        return horny_toad::mborder<jack_rabbit::subregion> (q, BORDER);
+    }
+    /// @brief denoise an image in parallel bands
+    image_t denoise_bands (const image_t &q, bool mirror) const
+    {
+        image_t p (q.rows (), q.cols ());
+        // splitting inside a parallel region would only add halo rows
+        const size_t n = omp_in_parallel () ? 1 : bands (q.rows (), omp_get_max_threads ());
+#pragma omp parallel for schedule (static) if (n > 1)
+        for (size_t k = 0; k < n; ++k)
+            denoise (q, p, k * q.rows () / n, (k + 1) * q.rows () / n, mirror);
         return p;
     }
+    /// @brief number of bands to split an image into
+    ///
+    /// @param rows number of rows in the image
+    /// @param wanted number of bands that would keep the threads busy
+    static size_t bands (size_t rows, size_t wanted)
+    {
+        // each band recomputes N rows above and below it, so keep them
+        // large compared to that
+        const size_t MIN_BAND_ROWS = 64;
+        return std::max (size_t (1), std::min (wanted, rows / MIN_BAND_ROWS));
+    }
+    public:
+    /// @brief count how often each pass looks up each context
+    ///
+    /// @param q noisy image
+    /// @param hits a table for each pass
+    void profile (const image_t &q, opp::lut1<size_t> *hits) const
+    {
+        image_t t (q);
+        for (size_t n = 0; n < N; ++n)
+        {
+            codec<C>::profile (hits[n], t, !(n & 1));
+            if (n + 1 < N)
+                t = c[n].denoise (t, !(n & 1), true);
+        }
+    }
+    /// @brief keep the outputs of a pass's most used contexts in a small table
+    ///
+    /// @param pass the pass
+    /// @param hits the count of each context is its total
+    /// @param k number of contexts to keep, or 0 for no hot table
+    void hot (size_t pass, const opp::lut1<size_t> &hits, size_t k)
+    {
+        c[pass].hot (hits, k);
+    }
+    /// @brief get a pass's codec
+    const codec<C> &pass_codec (size_t pass) const
+    {
+        return c[pass];
+    }
+    /// @brief get a pass's counts
+    const opp::lut1<size_t> &lut (size_t pass) const
+    {
+        return c[pass].lut ();
+    }
+    /// @brief get a pass's output table
+    const unsigned char *table (size_t pass) const
+    {
+        return c[pass].table ();
+    }
+    /// @brief run a single pass
+    ///
+    /// The edges of the output are zero, which is what training expects.
+    image_t denoise (const image_t &q, size_t pass) const
+    {
+        return c[pass].denoise (q, !(pass & 1));
+    }
+    /// @brief map a lut file read-only and query it in place
+    ///
+    /// @param fn lut file name
+    ///
+    /// Uncompressed tables are not copied, so concurrent processes that
+    /// map the same file share their pages.  Only the tables are read,
+    /// and their checksums are checked.
+    void map (const char *fn)
+    {
+        f.open (fn);
+        const opp::lut_file_section *s = opp::lut_file_sections (f.data (), f.size (), C::id (), N);
+        for (size_t n = 0; n < N; ++n)
+        {
+            const opp::lut_file_section &t = s[n * opp::LUT_FILE_SECTIONS_PER_PASS + opp::LUT_FILE_TABLE];
+            opp::lut_file_verify (f.data (), t);
+            const unsigned char *m = reinterpret_cast<const unsigned char *> (f.data () + t.offset);
+            if (t.compression == opp::LUT_FILE_RAW)
+                c[n].map (m, t.raw_size);
+            else
+            {
+                const std::vector<unsigned char> u = opp::lut_file_decode (f.data () + t.offset, t);
+                c[n].load (u.data (), u.size ());
+            }
+        }
+    }
+    /// @brief write the first few passes as a lut file
+    ///
+    /// @param s stream
+    /// @param passes number of passes to write, which must be finalized
+    /// @param compress compress the tables, which then can't be mapped in place
+    ///
+    /// A file with fewer than N passes holds the passes trained so far,
+    /// see mklut --pass.
+    void write (std::ostream &s, size_t passes, bool compress = false) const
+    {
+        assert (passes <= N);
+        opp::lut_file_writer w (C::id (), passes);
+        std::vector<uint32_t> k[N];
+        std::vector<uint64_t> t[N];
+        std::vector<uint64_t> x[N];
+        for (size_t n = 0; n < passes; ++n)
+        {
+            if (!c[n].table ())
+                throw std::runtime_error ("the codec has not been finalized");
+            c[n].lut ().sorted (k[n], t[n], x[n]);
+            w.add (k[n].data (), k[n].size (), sizeof (uint32_t));
+            w.add (t[n].data (), t[n].size (), sizeof (uint64_t));
+            w.add (x[n].data (), x[n].size (), sizeof (uint64_t));
+            w.add (c[n].table (), c[n].table_size (), 1, compress);
+        }
+        w.write (s);
+    }
+    /// @brief read a lut file that holds the first few passes
+    ///
+    /// @param s stream
+    /// @param passes number of passes in the file
+    ///
+    /// Every section is checked.  The passes that are read are
+    /// finalized.
+    void read (std::istream &s, size_t passes)
+    {
+        assert (passes <= N);
+        opp::lut_file_reader r (s, C::id (), passes);
+        for (size_t n = 0; n < passes; ++n)
+        {
+            const std::vector<unsigned char> k = r.read ();
+            const std::vector<unsigned char> t = r.read ();
+            const std::vector<unsigned char> x = r.read ();
+            const size_t count = k.size () / sizeof (uint32_t);
+            if (t.size () != count * sizeof (uint64_t) || x.size () != count * sizeof (uint64_t))
+                throw std::runtime_error ("corrupt lut file");
+            c[n].lut ().assign (reinterpret_cast<const uint32_t *> (k.data ()),
+                reinterpret_cast<const uint64_t *> (t.data ()),
+                reinterpret_cast<const uint64_t *> (x.data ()), count);
+            // the stored table is rebuilt from the counts
+            const std::vector<unsigned char> u = r.read ();
+            if (!codec<C>::sparse () && u.size () != codec<C>::dense_table_size ())
+                throw std::runtime_error ("lut file has the wrong table size");
+            c[n].finalize ();
+        }
+    }
     private:
     friend std::ostream& operator<< (std::ostream &s, const multi_codec &c)
     {
-        for (auto i : c.c)
-            s << i;
+        c.write (s, N);
         return s;
     }
     friend std::istream& operator>> (std::istream &s, multi_codec &c)
     {
-        for (auto &i : c.c)
-            s >> i;
+        c.read (s, N);
         return s;
     }
 };
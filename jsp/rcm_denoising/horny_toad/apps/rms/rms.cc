@@ -10,6 +10,7 @@
 #include "pnm.h"
 #include "raster.h"
 #include "raster_utils.h"
+#include "fft.h"
 #include "subscript_function.h"
 #include <boost/lambda/lambda.hpp>
 #include <fstream>
@@ -111,7 +112,7 @@ int main (int argc, char **argv)
         if (mean)
         {
             clog << "Computing mean..." << endl;
-            r = convolve<subregion> (img, w);
+            r = fast_convolve<subregion> (img, w);
         }
         else
         {
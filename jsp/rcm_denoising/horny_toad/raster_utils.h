@@ -373,6 +373,210 @@ typename WeightsIter::value_type local_rms_contrast (
     return sqrt (v) / m;
 }
 
+/// @brief Ways of computing weighted sums over every placement of a window
+enum local_sums_method
+{
+    /// @brief Every weight is applied at every placement
+    LOCAL_SUMS_DIRECT,
+    /// @brief The weights are an outer product, like a gaussian window
+    LOCAL_SUMS_SEPARABLE,
+    /// @brief The weights are all the same, so summed area tables work
+    LOCAL_SUMS_INTEGRAL
+};
+
+/// @brief Pick the fastest way to apply a weighting function
+/// @param W The weighting function type
+/// @param w The weighting function
+/// @param u Set to the column factors of separable weights
+/// @param v Set to the row factors of separable weights
+/// @return The method
+///
+/// When the method is LOCAL_SUMS_SEPARABLE, w (i, j) = u[i] * v[j].
+template<typename W>
+local_sums_method local_sums_method_for (const W &w, std::vector<double> &u, std::vector<double> &v)
+{
+    u.clear ();
+    v.clear ();
+    if (w.size () == 0)
+        return LOCAL_SUMS_DIRECT;
+    if (std::count (w.begin (), w.end (), w[0]) == static_cast<std::ptrdiff_t> (w.size ()))
+        return LOCAL_SUMS_INTEGRAL;
+    // the weights are separable if they are the outer product of the
+    // row and the column through their largest value
+    size_t r0 = 0;
+    size_t c0 = 0;
+    for (size_t i = 0; i < w.rows (); ++i)
+        for (size_t j = 0; j < w.cols (); ++j)
+            if (std::fabs (w (i, j)) > std::fabs (w (r0, c0)))
+                r0 = i, c0 = j;
+    const double m = w (r0, c0);
+    u.resize (w.rows ());
+    v.resize (w.cols ());
+    for (size_t i = 0; i < w.rows (); ++i)
+        u[i] = w (i, c0);
+    for (size_t j = 0; j < w.cols (); ++j)
+        v[j] = w (r0, j) / m;
+    for (size_t i = 0; i < w.rows (); ++i)
+    {
+        for (size_t j = 0; j < w.cols (); ++j)
+        {
+            if (std::fabs (w (i, j) - u[i] * v[j]) > 1e-12 * std::fabs (m))
+            {
+                u.clear ();
+                v.clear ();
+                return LOCAL_SUMS_DIRECT;
+            }
+        }
+    }
+    return LOCAL_SUMS_SEPARABLE;
+}
+
+/// @brief Pick the fastest way to apply a weighting function
+/// @param W The weighting function type
+/// @param w The weighting function
+/// @return The method
+///
+/// Radial windows, like raised_cos, are neither uniform nor
+/// separable, so they are applied directly.
+template<typename W>
+local_sums_method local_sums_method_for (const W &w)
+{
+    std::vector<double> u;
+    std::vector<double> v;
+    return local_sums_method_for (w, u, v);
+}
+
+/// @brief Compute weighted sums of an image and of its square over
+/// every placement of a window
+/// @param T The image type
+/// @param W The weighting function type
+/// @param img The image
+/// @param w The weighting function
+/// @param sx The weighted sums
+/// @param sxx The weighted sums of squares
+/// @return The method that was used
+///
+/// The sums are row major and indexed by the top left corner of the
+/// window, so there are img.rows () - w.rows () + 1 rows of
+/// img.cols () - w.cols () + 1 sums.
+///
+/// The method is picked by local_sums_method_for ().  Uniform weights
+/// take O(1) per placement, separable weights take
+/// O(w.rows () + w.cols ()), and anything else, like the rms app's
+/// raised_cos window, takes O(w.rows () * w.cols ()).  Summed area
+/// tables subtract large sums, so they lose a little precision on
+/// large images.
+template<typename T,typename W>
+local_sums_method local_sums (const T &img, const W &w, std::vector<double> &sx, std::vector<double> &sxx)
+{
+    assert (img.rows () >= w.rows ());
+    assert (img.cols () >= w.cols ());
+    const size_t R = img.rows () - w.rows () + 1;
+    const size_t C = img.cols () - w.cols () + 1;
+    sx.assign (R * C, 0.0);
+    sxx.assign (R * C, 0.0);
+    // w (i, j) = u[i] * v[j] for separable weights
+    std::vector<double> u;
+    std::vector<double> v;
+    const local_sums_method method = local_sums_method_for (w, u, v);
+    switch (method)
+    {
+        case LOCAL_SUMS_INTEGRAL:
+        {
+            // summed area tables with a row and column of zeros in front
+            const size_t N = img.cols () + 1;
+            std::vector<double> a ((img.rows () + 1) * N);
+            std::vector<double> aa (a.size ());
+            for (size_t i = 0; i < img.rows (); ++i)
+            {
+                double s = 0.0;
+                double ss = 0.0;
+                for (size_t j = 0; j < img.cols (); ++j)
+                {
+                    const double x = img (i, j);
+                    s += x;
+                    ss += x * x;
+                    a[(i + 1) * N + j + 1] = a[i * N + j + 1] + s;
+                    aa[(i + 1) * N + j + 1] = aa[i * N + j + 1] + ss;
+                }
+            }
+            const double k = w[0];
+            for (size_t r = 0; r < R; ++r)
+            {
+                const size_t t = r * N;
+                const size_t b = (r + w.rows ()) * N;
+                for (size_t c = 0; c < C; ++c)
+                {
+                    const size_t l = c;
+                    const size_t e = c + w.cols ();
+                    sx[r * C + c] = k * (a[b + e] - a[t + e] - a[b + l] + a[t + l]);
+                    sxx[r * C + c] = k * (aa[b + e] - aa[t + e] - aa[b + l] + aa[t + l]);
+                }
+            }
+        }
+        break;
+        case LOCAL_SUMS_SEPARABLE:
+        {
+            // filter the rows
+            std::vector<double> h (img.rows () * C);
+            std::vector<double> hh (h.size ());
+            for (size_t i = 0; i < img.rows (); ++i)
+            {
+                for (size_t c = 0; c < C; ++c)
+                {
+                    double s = 0.0;
+                    double ss = 0.0;
+                    for (size_t j = 0; j < v.size (); ++j)
+                    {
+                        const double x = img (i, c + j);
+                        s += v[j] * x;
+                        ss += v[j] * x * x;
+                    }
+                    h[i * C + c] = s;
+                    hh[i * C + c] = ss;
+                }
+            }
+            // then the columns
+            for (size_t r = 0; r < R; ++r)
+            {
+                for (size_t i = 0; i < u.size (); ++i)
+                {
+                    const double *p = &h[(r + i) * C];
+                    const double *pp = &hh[(r + i) * C];
+                    for (size_t c = 0; c < C; ++c)
+                    {
+                        sx[r * C + c] += u[i] * p[c];
+                        sxx[r * C + c] += u[i] * pp[c];
+                    }
+                }
+            }
+        }
+        break;
+        case LOCAL_SUMS_DIRECT:
+        for (size_t r = 0; r < R; ++r)
+        {
+            for (size_t c = 0; c < C; ++c)
+            {
+                double s = 0.0;
+                double ss = 0.0;
+                for (size_t i = 0; i < w.rows (); ++i)
+                {
+                    for (size_t j = 0; j < w.cols (); ++j)
+                    {
+                        const double x = img (r + i, c + j);
+                        s += w (i, j) * x;
+                        ss += w (i, j) * x * x;
+                    }
+                }
+                sx[r * C + c] = s;
+                sxx[r * C + c] = ss;
+            }
+        }
+        break;
+    }
+    return method;
+}
+
 /// @brief Compute RMS contrast across an entire image
 /// @param S The subregion type
 /// @param C The contrast and weighting function type
@@ -388,6 +592,9 @@ typename WeightsIter::value_type local_rms_contrast (
 /// work)
 /// @note The weighting function type determines the
 /// contrast type.
+///
+/// The local sums come from local_sums (), so uniform and separable
+/// weights are much faster than a window at a time.
 template<typename S,typename C,typename T>
 C rms_contrast (const T &img, const C &weights, double dark_light = 0.0)
 {
@@ -398,14 +605,21 @@ C rms_contrast (const T &img, const C &weights, double dark_light = 0.0)
     const size_t c_offset = weights.cols () / 2;
     const size_t r_max = img.rows () - r_offset;
     const size_t c_max = img.cols () - c_offset;
+    std::vector<double> sx;
+    std::vector<double> sxx;
+    local_sums (img, weights, sx, sxx);
+    const size_t stride = img.cols () - weights.cols () + 1;
     C contrast (img.rows (), img.cols ());
     for (size_t r = r_offset; r < r_max; ++r)
     {
         for (size_t c = c_offset; c < c_max; ++c)
         {
-            S s = { r - r_offset, c - c_offset, weights.rows (), weights.cols () };
-            typename C::value_type rms = local_rms_contrast_p (img.begin (s), img.end (s), weights.begin (), w_sum, dark_light);
-            assert (rms >= 0.0);
+            const size_t k = (r - r_offset) * stride + c - c_offset;
+            // sum of w (x - lum)^2 is sum of w x^2 less w_sum lum^2
+            const double lum = sx[k] / w_sum;
+            const double ss = std::max (0.0, sxx[k] / w_sum - lum * lum);
+            typename C::value_type rms = sqrt (ss / ((lum + dark_light) * (lum + dark_light)));
+            assert (!(rms < 0.0));
             assert (r < contrast.rows ());
             assert (c < contrast.cols ());
             contrast (r, c) = rms;
@@ -427,7 +641,9 @@ C rms_contrast (const T &img, const C &weights, double dark_light = 0.0)
 /// @note The subregion type must be compatible with the
 /// image subregion iterators (e.g.: jack_rabbit::subregion)
 ///
-/// This version returns both the contrast and the mean.
+/// This version returns both the contrast and the mean.  Like
+/// local_mean (), the mean is the weighted sum, so the weights
+/// should add up to one.
 template<typename S,typename T,typename W,typename C,typename M>
 void rms_contrast_m (const T &img, const W &w, C &c, M &m)
 {
@@ -441,15 +657,21 @@ void rms_contrast_m (const T &img, const W &w, C &c, M &m)
     const size_t c_min = w.cols () / 2;
     const size_t r_max = img.rows () - r_min;
     const size_t c_max = img.cols () - c_min;
+    const double w_sum = std::accumulate (w.begin (), w.end (), 0.0);
+    std::vector<double> sx;
+    std::vector<double> sxx;
+    local_sums (img, w, sx, sxx);
+    const size_t stride = img.cols () - w.cols () + 1;
     for (size_t row = r_min; row < r_max; ++row)
     {
         for (size_t col = c_min; col < c_max; ++col)
         {
-            S s = { row - r_min, col - c_min, w.rows (), w.cols () };
             assert (row < c.rows ());
             assert (col < c.cols ());
-            typename W::value_type lv = local_variance (img.begin (s), img.end (s), w.begin ());
-            typename W::value_type lm = local_mean (img.begin (s), img.end (s), w.begin ());
+            const size_t k = (row - r_min) * stride + col - c_min;
+            // local_variance () is the sum of w (x - lm)^2
+            typename W::value_type lm = sx[k];
+            typename W::value_type lv = std::max (0.0, sxx[k] - 2.0 * lm * sx[k] + lm * lm * w_sum);
             m (row, col) = lm;
             c (row, col) = sqrt (lv) / lm;
         }
@@ -472,6 +694,34 @@ size_t reflect (int i, size_t n)
     return i;
 }
 
+/// @brief Dot product a kernel and an image patch that lies inside the image
+/// @tparam T Kernel type
+/// @tparam U Image type
+/// @param k kernel
+/// @param p image
+/// @param start_i row,column offset within the image
+/// @param start_j
+/// @return The dot product
+///
+/// Each row is walked with plain pointers so that the compiler can
+/// vectorize it.  The taps are summed in the same order as
+/// mirrored_dot_product () sums them.
+template<typename T,typename U>
+double dot_product (const T &k, const U &p, size_t start_i, size_t start_j)
+{
+    assert (start_i + k.rows () <= p.rows ());
+    assert (start_j + k.cols () <= p.cols ());
+    double sum = 0.0;
+    for (size_t i = 0; i < k.rows (); ++i)
+    {
+        const typename T::value_type *kr = &k (i, 0);
+        const typename U::value_type *pr = &p (start_i + i, start_j);
+        for (size_t j = 0; j < k.cols (); ++j)
+            sum += kr[j] * pr[j];
+    }
+    return sum;
+}
+
 /// @brief Dot product a kernel and an image patch, mirroring if necessary
 /// @tparam T Kernel type
 /// @tparam U Image type
@@ -482,23 +732,30 @@ size_t reflect (int i, size_t n)
 /// @return The dot product
 ///
 /// The kernel should have odd dimensions, and the kernel must be smaller than the image.
+///
+/// Patches inside the image go through dot_product ().  Only patches
+/// that hang over an edge are reflected, and then each row and
+/// column is reflected once instead of once per tap.
 template<typename T,typename U>
 double mirrored_dot_product (const T &k, const U &p, int start_i, int start_j)
 {
     assert (k.rows () < p.rows ());
     assert (k.cols () < p.cols ());
+    if (start_i >= 0 && size_t (start_i) + k.rows () <= p.rows ()
+        && start_j >= 0 && size_t (start_j) + k.cols () <= p.cols ())
+        return dot_product (k, p, start_i, start_j);
+    std::vector<size_t> jj (k.cols ());
+    for (size_t j = 0; j < k.cols (); ++j)
+        jj[j] = reflect (start_j + j, p.cols () - 1);
     double sum = 0.0;
     for (size_t i = 0; i < k.rows (); ++i)
     {
-        int ii = reflect (start_i + i, p.rows () - 1);
+        const size_t ii = reflect (start_i + i, p.rows () - 1);
+        assert (ii < p.rows ());
         for (size_t j = 0; j < k.cols (); ++j)
         {
-            int jj = reflect (start_j + j, p.cols () - 1);
-            assert (i < k.rows ());
-            assert (j < k.cols ());
-            assert (static_cast<size_t> (ii) < p.rows ());
-            assert (static_cast<size_t> (jj) < p.cols ());
-            sum += k (i, j) * p (ii, jj);
+            assert (jj[j] < p.cols ());
+            sum += k (i, j) * p (ii, jj[j]);
         }
     }
     return sum;
@@ -516,6 +773,13 @@ double mirrored_dot_product (const T &k, const U &p, int start_i, int start_j)
 /// @note The image type is independent of the kernel type
 /// (e.g.: unsigned char images work)
 /// @note The kernel type determines the returned type.
+/// @note Only rows from kernel.rows () / 2 up to
+/// img.rows () - kernel.rows () are computed, and likewise for
+/// columns.  The rest of the output is zero.  The subregion type is
+/// no longer used, but is kept so that callers don't change.
+///
+/// For large kernels, fft_convolve () in fft.h computes the same
+/// values with FFTs, and fast_convolve () there picks between the two.
 template<typename S,typename K,typename T>
 K convolve (const T &img, const K &kernel)
 {
@@ -528,12 +792,40 @@ K convolve (const T &img, const K &kernel)
     {
         for (size_t c = c_offset; c < c_max; ++c)
         {
-            S s = { r - r_offset, c - c_offset, kernel.rows (), kernel.cols () };
-            typename K::value_type v = inner_product (img.begin (s), img.end (s),
-                kernel.begin (), 0.0);
             assert (r < ret.rows ());
             assert (c < ret.cols ());
-            ret (r, c) = v;
+            ret (r, c) = dot_product (kernel, img, r - r_offset, c - c_offset);
+        }
+    }
+    return ret;
+}
+
+/// @brief Convolve a kernel with an image, mirroring at the edges
+/// @param K The kernel type
+/// @param T The image type
+/// @param img The image
+/// @param kernel A centered kernel, smaller than the image
+/// @return The output values
+/// @note The kernel type determines the returned type.
+///
+/// Unlike convolve (), every point of the output is computed.  The
+/// interior goes through dot_product (), and only the points within
+/// half a kernel of an edge are reflected.
+template<typename K,typename T>
+K mirrored_convolve (const T &img, const K &kernel)
+{
+    const size_t r_offset = kernel.rows () / 2;
+    const size_t c_offset = kernel.cols () / 2;
+    K ret (img.rows (), img.cols ());
+    for (size_t r = 0; r < img.rows (); ++r)
+    {
+        const bool inside = r >= r_offset && r - r_offset + kernel.rows () <= img.rows ();
+        for (size_t c = 0; c < img.cols (); ++c)
+        {
+            if (inside && c >= c_offset && c - c_offset + kernel.cols () <= img.cols ())
+                ret (r, c) = dot_product (kernel, img, r - r_offset, c - c_offset);
+            else
+                ret (r, c) = mirrored_dot_product (kernel, img, int (r) - int (r_offset), int (c) - int (c_offset));
         }
     }
     return ret;
@@ -5,13 +5,20 @@
 /// @date 2013-01-14
 
 #include "horny_toad/fft.h"
+#include "jack_rabbit/raster.h"
+#include "horny_toad/raster_utils.h"
 #include "horny_toad/verify.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <iterator>
 #include <vector>
+#include <unistd.h>
 
 using namespace std;
 using namespace horny_toad;
+using namespace jack_rabbit;
 
 template<typename T,int DIMS,int SZ>
 void test_fft (bool verbose)
@@ -64,6 +71,125 @@ void test_fft (bool verbose)
     icfft ();
 }
 
+/// @brief Transform real data forward and back, returning the largest error
+///
+/// @param off offset of the arrays within their buffers, in doubles
+double round_trip (int rows, int cols, size_t off, unsigned flags)
+{
+    const int dims[2] = { rows, cols };
+    const size_t rsize = rows * cols;
+    const size_t csize = rows * (cols / 2 + 1);
+    vector<double> rbuf (rsize + off);
+    vector<double> cbuf (2 * (csize + off));
+    double *r = &rbuf[off];
+    complex<double> *c = reinterpret_cast<complex<double> *> (&cbuf[off]);
+    vector<double> x (rsize);
+    for (size_t i = 0; i < rsize; ++i)
+        x[i] = r[i] = rand () % 1000 / 10.0;
+    forward_real_fft f (dims, dims + 2, r, r + rsize, c, c + csize, flags);
+    inverse_real_fft g (dims, dims + 2, c, c + csize, r, r + rsize, flags);
+    // planning doesn't touch the data
+    for (size_t i = 0; i < rsize; ++i)
+        VERIFY (r[i] == x[i]);
+    f ();
+    g ();
+    double e = 0.0;
+    for (size_t i = 0; i < rsize; ++i)
+        e = max (e, fabs (r[i] / rsize - x[i]));
+    return e;
+}
+
+void test_plan_cache (bool verbose)
+{
+    const size_t n0 = fft_plans ().size ();
+    // the same plan is shared by every transform of the same size
+    VERIFY (round_trip (12, 34, 0, FFTW_MEASURE) < 1e-9);
+    const size_t n1 = fft_plans ().size ();
+    VERIFY (n1 == n0 + 2);
+    VERIFY (round_trip (12, 34, 0, FFTW_MEASURE) < 1e-9);
+    VERIFY (fft_plans ().size () == n1);
+    // other flags and alignments get their own plans
+    VERIFY (round_trip (12, 34, 0, FFTW_ESTIMATE) < 1e-9);
+    VERIFY (round_trip (12, 34, 1, FFTW_MEASURE) < 1e-9);
+    const size_t n2 = fft_plans ().size ();
+    VERIFY (n2 > n1);
+    // in place
+    vector<complex<double> > c (16 * 16);
+    for (size_t i = 0; i < c.size (); ++i)
+        c[i] = complex<double> (rand () % 100, rand () % 100);
+    const vector<complex<double> > d (c);
+    const int dims[2] = { 16, 16 };
+    forward_complex_fft f (dims, dims + 2, c.begin (), c.end (), c.begin (), c.end (), FFTW_MEASURE);
+    inverse_complex_fft g (dims, dims + 2, c.begin (), c.end (), c.begin (), c.end (), FFTW_MEASURE);
+    VERIFY (fft_plans ().size () == n2 + 2);
+    f ();
+    g ();
+    for (size_t i = 0; i < c.size (); ++i)
+        VERIFY (abs (c[i] / double (c.size ()) - d[i]) < 1e-9);
+    // several threads planning and transforming at once
+    const int sizes = 24;
+    vector<double> errors (sizes);
+#pragma omp parallel for
+    for (int n = 0; n < sizes; ++n)
+        errors[n] = round_trip (8 + n % 6, 9 + n % 8, n % 2, FFTW_MEASURE);
+    for (int n = 0; n < sizes; ++n)
+        VERIFY (errors[n] < 1e-9);
+    if (verbose)
+        clog << fft_plans ().size () << " plans" << endl;
+}
+
+void test_wisdom (bool verbose)
+{
+    char fn[] = "/tmp/test_fft_wisdomXXXXXX";
+    const int fd = mkstemp (fn);
+    VERIFY (fd != -1);
+    close (fd);
+    VERIFY (round_trip (20, 30, 0, FFTW_PATIENT) < 1e-9);
+    VERIFY (fft_plan_flags () == FFTW_ESTIMATE);
+    VERIFY (save_fft_wisdom (fn));
+    VERIFY (load_fft_wisdom (fn));
+    // plans are measured once there is wisdom
+    VERIFY (fft_plan_flags () == FFTW_MEASURE);
+    fft_plans ().measure (false);
+    remove (fn);
+    VERIFY (!load_fft_wisdom (fn));
+    VERIFY (fft_plan_flags () == FFTW_ESTIMATE);
+    use_fft_wisdom (fn);
+    VERIFY (fft_plan_flags () == FFTW_MEASURE);
+    fft_plans ().measure (false);
+    if (verbose)
+        clog << "wisdom saved and loaded" << endl;
+}
+
+void test_fft_convolve (bool verbose)
+{
+    // both compute the same points, to within rounding
+    for (size_t kr = 1; kr <= 9; kr += 2)
+    {
+        for (size_t kc = 1; kc <= 12; kc += 3)
+        {
+            raster<double> k (kr, kc);
+            for (size_t i = 0; i < k.size (); ++i)
+                k[i] = rand () % 100 / 10.0 - 5.0;
+            raster<uint16_t> p (37, 50);
+            for (size_t i = 0; i < p.size (); ++i)
+                p[i] = rand () % 256;
+            const raster<double> d = convolve<subregion> (p, k);
+            const raster<double> f = fft_convolve (p, k);
+            const raster<double> g = fast_convolve<subregion> (p, k);
+            VERIFY (f.rows () == p.rows () && f.cols () == p.cols ());
+            VERIFY (g.rows () == p.rows () && g.cols () == p.cols ());
+            for (size_t i = 0; i < d.size (); ++i)
+            {
+                VERIFY (fabs (f[i] - d[i]) < 1e-6);
+                VERIFY (fabs (g[i] - d[i]) < 1e-6);
+            }
+        }
+    }
+    if (verbose)
+        clog << "fft_convolve () and fast_convolve () match convolve ()" << endl;
+}
+
 int main (int argc, char **)
 {
     try
@@ -75,6 +201,9 @@ int main (int argc, char **)
         test_fft<double,4,7> (verbose);
         test_fft<double,2,100> (verbose);
         test_fft<double,2,123> (verbose);
+        test_plan_cache (verbose);
+        test_wisdom (verbose);
+        test_fft_convolve (verbose);
 
         return 0;
     }
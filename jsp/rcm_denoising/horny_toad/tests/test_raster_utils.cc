@@ -377,6 +377,57 @@ void test_rms_contrast_image (bool verbose)
     }
 }
 
+void test_local_sums (bool verbose)
+{
+    raster<unsigned char> img (40, 50);
+    for (size_t i = 0; i < img.size (); ++i)
+        img[i] = rand () % 256;
+    raster<double> uniform (7, 7, 1.0 / 49);
+    raster<double> wide (4, 6, 1.0 / 24);
+    raster<double> gaussian (9, 9, 1.0);
+    subscript_unary_function<double,gaussian_window> g (gaussian.rows (), gaussian.cols ());
+    g.stddev (2.0);
+    transform (gaussian.begin (), gaussian.end (), gaussian.begin (), g);
+    double g_sum = accumulate (gaussian.begin (), gaussian.end (), 0.0);
+    for_each (gaussian.begin (), gaussian.end (), _1 = _1 / g_sum);
+    raster<double> cosine (5, 5);
+    subscript_generator<double,raised_cos> r (cosine.rows (), cosine.cols ());
+    generate (cosine.begin (), cosine.end (), r);
+    double c_sum = accumulate (cosine.begin (), cosine.end (), 0.0);
+    for_each (cosine.begin (), cosine.end (), _1 = _1 / c_sum);
+    VERIFY (local_sums_method_for (uniform) == LOCAL_SUMS_INTEGRAL);
+    VERIFY (local_sums_method_for (wide) == LOCAL_SUMS_INTEGRAL);
+    VERIFY (local_sums_method_for (gaussian) == LOCAL_SUMS_SEPARABLE);
+    VERIFY (local_sums_method_for (cosine) == LOCAL_SUMS_DIRECT);
+    const raster<double> *ws[] = { &uniform, &wide, &gaussian, &cosine };
+    for (auto w : ws)
+    {
+        // every method against a window at a time
+        const double w_sum = accumulate (w->begin (), w->end (), 0.0);
+        raster<double> c = rms_contrast<subregion> (img, *w, 1.0);
+        raster<double> c2 (img.rows (), img.cols ());
+        raster<double> m2 (img.rows (), img.cols ());
+        rms_contrast_m<subregion> (img, *w, c2, m2);
+        const size_t r_offset = w->rows () / 2;
+        const size_t c_offset = w->cols () / 2;
+        for (size_t i = r_offset; i < img.rows () - r_offset; ++i)
+        {
+            for (size_t j = c_offset; j < img.cols () - c_offset; ++j)
+            {
+                subregion s = { i - r_offset, j - c_offset, w->rows (), w->cols () };
+                const double rms = local_rms_contrast_p (img.begin (s), img.end (s), w->begin (), w_sum, 1.0);
+                const double lm = local_mean (img.begin (s), img.end (s), w->begin ());
+                const double lv = local_variance (img.begin (s), img.end (s), w->begin ());
+                VERIFY (fabs (c (i, j) - rms) < 1e-9);
+                VERIFY (fabs (m2 (i, j) - lm) < 1e-9);
+                VERIFY (fabs (c2 (i, j) - sqrt (lv) / lm) < 1e-9);
+            }
+        }
+        if (verbose)
+            print2d (clog, c);
+    }
+}
+
 void test_convolve (bool verbose)
 {
     // Test convolution across an entire image
@@ -541,6 +592,54 @@ void test_mirrored_dot_product (bool verbose)
     VERIFY (d1 == d2);
 }
 
+void test_dot_product_fast_path (bool verbose)
+{
+    raster<int> p (23, 31);
+    generate (p.begin (), p.end (), rand);
+    for (size_t i = 0; i < p.size (); ++i)
+        p[i] %= 256;
+    raster<double> k (5, 7);
+    for (size_t i = 0; i < k.size (); ++i)
+        k[i] = rand () % 100 / 10.0;
+    // every position, including the ones that hang over the edges,
+    // against a tap by tap reflection
+    for (int i = 1 - int (k.rows ()); i < int (p.rows ()); ++i)
+    {
+        for (int j = 1 - int (k.cols ()); j < int (p.cols ()); ++j)
+        {
+            double sum = 0.0;
+            for (size_t ki = 0; ki < k.rows (); ++ki)
+                for (size_t kj = 0; kj < k.cols (); ++kj)
+                    sum += k (ki, kj) * p (reflect (i + ki, p.rows () - 1), reflect (j + kj, p.cols () - 1));
+            VERIFY (mirrored_dot_product (k, p, i, j) == sum);
+        }
+    }
+    // convolve () only fills in the interior
+    raster<double> c = convolve<subregion> (p, k);
+    raster<double> m = mirrored_convolve (p, k);
+    for (size_t i = 0; i < p.rows (); ++i)
+    {
+        for (size_t j = 0; j < p.cols (); ++j)
+        {
+            const int si = int (i) - int (k.rows () / 2);
+            const int sj = int (j) - int (k.cols () / 2);
+            // the points that convolve () has always computed
+            const bool inside = si >= 0 && i + k.rows () <= p.rows ()
+                && sj >= 0 && j + k.cols () <= p.cols ();
+            if (inside)
+            {
+                subregion s = { size_t (si), size_t (sj), k.rows (), k.cols () };
+                VERIFY (c (i, j) == inner_product (p.begin (s), p.end (s), k.begin (), 0.0));
+            }
+            else
+                VERIFY (c (i, j) == 0.0);
+            VERIFY (m (i, j) == mirrored_dot_product (k, p, si, sj));
+        }
+    }
+    if (verbose)
+        print2d (clog, m);
+}
+
 void test_crop (bool verbose)
 {
     raster<int> p (9, 9);
@@ -676,11 +775,13 @@ int main (int argc, char **)
         test_variance (verbose);
         test_rms_contrast (verbose);
         test_rms_contrast_image (verbose);
+        test_local_sums (verbose);
         test_convolve (verbose);
         test_split3_join3 (verbose);
         test_transform3 (verbose);
         test_reflect (verbose);
         test_mirrored_dot_product (verbose);
+        test_dot_product_fast_path (verbose);
         test_crop (verbose);
         test_border (verbose);
         test_flip (verbose);
@@ -688,7 +789,7 @@ int main (int argc, char **)
 
         return 0;
     }
-    catch (const exception &e)
+    catch (const std::exception &e)
     {
         cerr << e.what () << endl;
         return -1;
@@ -0,0 +1,239 @@
+/// @file lookup.h
+/// @brief context table lookups
+/// @author Jeff Perry <jeffsp@gmail.com>
+/// @version 1.0
+/// @date 2015-07-06
+
+#ifndef LOOKUP_H
+#define LOOKUP_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+#if defined (__x86_64__) || defined (__i386__)
+#define OPP_LOOKUP_AVX2
+#include <immintrin.h>
+#endif
+
+namespace opp
+{
+    /// @brief q[k] = t[(a[k] << 16) | (b[k] << 8) | c[k]] for n pixels
+    ///
+    /// @param a first tap of each context
+    /// @param b second tap
+    /// @param c third tap
+    /// @param q output pixels
+    /// @param n number of pixels
+    /// @param t output table, indexed by context
+    inline void lookup888_scalar (const unsigned char *a, const unsigned char *b, const unsigned char *c,
+        unsigned char *q, size_t n, const unsigned char *t)
+    {
+        for (size_t k = 0; k < n; ++k)
+            q[k] = t[(a[k] << 16) | (b[k] << 8) | c[k]];
+    }
+
+#ifdef OPP_LOOKUP_AVX2
+    /// @brief expand 8 bytes to 8 32-bit lanes
+    __attribute__ ((target ("avx2")))
+    inline __m256i load8_epi32 (const unsigned char *p)
+    {
+        return _mm256_cvtepu8_epi32 (_mm_loadl_epi64 (reinterpret_cast<const __m128i *> (p)));
+    }
+
+    /// @brief compute 8 context indexes
+    __attribute__ ((target ("avx2")))
+    inline __m256i index888_epi32 (const unsigned char *a, const unsigned char *b, const unsigned char *c)
+    {
+        return _mm256_or_si256 (
+            _mm256_or_si256 (_mm256_slli_epi32 (load8_epi32 (a), 16), _mm256_slli_epi32 (load8_epi32 (b), 8)),
+            load8_epi32 (c));
+    }
+
+    /// @brief AVX2 version of lookup888_scalar ()
+    ///
+    /// Looks up 16 contexts at a time with two 8-lane gathers.
+    ///
+    /// A gather reads 32 bits, so each lane reads the 4 bytes ending at
+    /// its table entry, and the table must be preceded by at least 3
+    /// readable bytes.
+    __attribute__ ((target ("avx2")))
+    inline void lookup888_avx2 (const unsigned char *a, const unsigned char *b, const unsigned char *c,
+        unsigned char *q, size_t n, const unsigned char *t)
+    {
+        const int *base = reinterpret_cast<const int *> (t - 3);
+        size_t k = 0;
+        for (; k + 16 <= n; k += 16)
+        {
+            __m256i g0 = _mm256_i32gather_epi32 (base, index888_epi32 (a + k, b + k, c + k), 1);
+            __m256i g1 = _mm256_i32gather_epi32 (base, index888_epi32 (a + k + 8, b + k + 8, c + k + 8), 1);
+            // the entries are in the top byte of each lane
+            g0 = _mm256_srli_epi32 (g0, 24);
+            g1 = _mm256_srli_epi32 (g1, 24);
+            // pack to 16 bits, then undo the per-lane interleave
+            __m256i w = _mm256_permute4x64_epi64 (_mm256_packus_epi32 (g0, g1), 0xD8);
+            // pack to 8 bits, then gather the two low quadwords
+            __m256i v = _mm256_permute4x64_epi64 (_mm256_packus_epi16 (w, w), 0x08);
+            _mm_storeu_si128 (reinterpret_cast<__m128i *> (q + k), _mm256_castsi256_si128 (v));
+        }
+        lookup888_scalar (a + k, b + k, c + k, q + k, n - k, t);
+    }
+#endif
+
+    /// @brief check if the AVX2 lookups can be used on this cpu
+    inline bool have_avx2 ()
+    {
+#ifdef OPP_LOOKUP_AVX2
+        static const bool avx2 = __builtin_cpu_supports ("avx2");
+        return avx2;
+#else
+        return false;
+#endif
+    }
+
+    /// @brief q[k] = t[(a[k] << 16) | (b[k] << 8) | c[k]] for n pixels
+    ///
+    /// Uses the fastest version that this cpu supports.  The table must
+    /// be preceded by at least 3 readable bytes.
+    inline void lookup888 (const unsigned char *a, const unsigned char *b, const unsigned char *c,
+        unsigned char *q, size_t n, const unsigned char *t)
+    {
+#ifdef OPP_LOOKUP_AVX2
+        if (have_avx2 ())
+        {
+            lookup888_avx2 (a, b, c, q, n, t);
+            return;
+        }
+#endif
+        lookup888_scalar (a, b, c, q, n, t);
+    }
+
+    /// @brief read only map from context index to output value
+    ///
+    /// Used in place of a dense table when the context index has too
+    /// many bits to give every context an entry.  The table is an open
+    /// addressed hash laid out as
+    ///
+    ///     uint32_t keys[slots]
+    ///     uint8_t values[slots]
+    ///
+    /// so that a built table can be written to a file and later queried
+    /// in place.  The number of slots is a power of two.
+    class sparse_table
+    {
+        public:
+        static const uint32_t EMPTY = ~0u;
+        sparse_table ()
+            : keys (0)
+            , values (0)
+            , bits (0)
+        { }
+        /// @brief constructor
+        ///
+        /// @param p table that was laid out by build (), 4 byte aligned
+        /// @param sz size of the table in bytes
+        sparse_table (const unsigned char *p, size_t sz)
+            : keys (reinterpret_cast<const uint32_t *> (p))
+            , values (p + sz / 5 * sizeof (uint32_t))
+            , bits (0)
+        {
+            const size_t n = sz / 5;
+            if (n < MIN_SLOTS || n * 5 != sz || (n & (n - 1)) != 0)
+                throw std::runtime_error ("invalid sparse table size");
+            while ((size_t (1) << bits) < n)
+                ++bits;
+        }
+        /// @brief get the number of bytes in a table with count entries
+        static size_t bytes (size_t count)
+        {
+            return slots (count) * 5;
+        }
+        /// @brief lay out a table
+        ///
+        /// @param k keys
+        /// @param v value of each key
+        /// @param count number of keys
+        /// @param p destination, which must hold bytes (count) bytes
+        static void build (const uint32_t *k, const unsigned char *v, size_t count, unsigned char *p)
+        {
+            const size_t n = slots (count);
+            uint32_t *keys = reinterpret_cast<uint32_t *> (p);
+            unsigned char *values = p + n * sizeof (uint32_t);
+            std::fill (keys, keys + n, uint32_t (EMPTY));
+            std::fill (values, values + n, 0);
+            size_t b = 0;
+            while ((size_t (1) << b) < n)
+                ++b;
+            for (size_t i = 0; i < count; ++i)
+            {
+                assert (k[i] != EMPTY);
+                size_t s = slot (k[i], b);
+                while (keys[s] != EMPTY)
+                    s = (s + 1) & (n - 1);
+                keys[s] = k[i];
+                values[s] = v[i];
+            }
+        }
+        /// @brief get the value of a key
+        ///
+        /// @param k the key
+        /// @param missing value of keys that are not in the table
+        unsigned char lookup (uint32_t k, unsigned char missing) const
+        {
+            unsigned char v;
+            return find (k, v) ? v : missing;
+        }
+        /// @brief get the value of a key, if it is in the table
+        ///
+        /// @param k the key
+        /// @param v set to the value of the key
+        ///
+        /// @return true if the key was found
+        bool find (uint32_t k, unsigned char &v) const
+        {
+            const size_t mask = (size_t (1) << bits) - 1;
+            for (size_t s = slot (k, bits); ; s = (s + 1) & mask)
+            {
+                if (keys[s] == k)
+                {
+                    v = values[s];
+                    return true;
+                }
+                if (keys[s] == EMPTY)
+                    return false;
+            }
+        }
+        /// @brief number of slots
+        size_t slots () const
+        {
+            return size_t (1) << bits;
+        }
+        /// @brief the slot where the search for a key starts
+        size_t home (uint32_t k) const
+        {
+            return slot (k, bits);
+        }
+        private:
+        static const size_t MIN_SLOTS = 16;
+        /// @brief keep the load factor under 1/2
+        static size_t slots (size_t count)
+        {
+            size_t n = MIN_SLOTS;
+            while (n < 2 * count)
+                n *= 2;
+            return n;
+        }
+        /// @brief fibonacci hash, the same as lut1's
+        static size_t slot (uint32_t k, size_t bits)
+        {
+            return (k * 0x9E3779B97F4A7C15ull) >> (64 - bits);
+        }
+        const uint32_t *keys;
+        const unsigned char *values;
+        size_t bits;
+    };
+}
+
+#endif
@@ -0,0 +1,542 @@
+/// @file lut_file.h
+/// @brief on-disk lookup table format
+/// @author Jeff Perry <jeffsp@gmail.com>
+/// @version 1.0
+/// @date 2015-07-04
+
+#ifndef LUT_FILE_H
+#define LUT_FILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace opp
+{
+    /// @brief lut file header
+    ///
+    /// A lut file is a header, a table of sections, and the sections:
+    ///
+    ///     lut_file_header
+    ///     lut_file_section[sections]
+    ///     for each pass:
+    ///         keys        uint32_t[count], sorted context indexes
+    ///         totals      uint64_t[count]
+    ///         sums        uint64_t[count]
+    ///         table       uint8_t[], output value of every context, or
+    ///                     a sparse_table
+    ///
+    /// Every section starts on an 8 byte boundary, and all offsets are
+    /// from the start of the file, so an uncompressed table can be
+    /// mapped read-only and queried in place.
+    ///
+    /// Values are stored in the byte order of the machine that wrote
+    /// the file, which is recorded so that a file from a machine with
+    /// the other byte order is rejected rather than misread.
+    ///
+    /// The header checksum covers the header and the section table, and
+    /// each section has a checksum of its stored bytes, so a reader
+    /// only has to check the sections that it uses.
+    struct lut_file_header
+    {
+        char magic[8];
+        uint32_t version;
+        /// @brief LUT_FILE_BYTE_ORDER as written by the machine that wrote the file
+        uint32_t byte_order;
+        /// @brief identifies the context shape that the lut was trained with
+        uint32_t context;
+        uint32_t passes;
+        uint32_t sections;
+        /// @brief sizes of a key, a total, a sum, and an output value
+        uint8_t key_size;
+        uint8_t total_size;
+        uint8_t sum_size;
+        uint8_t value_size;
+        uint64_t file_size;
+        /// @brief crc32c of the header, with this field set to zero, and the section table
+        uint32_t checksum;
+        uint32_t reserved;
+    };
+
+    /// @brief lut file section table entry
+    struct lut_file_section
+    {
+        uint32_t type;
+        uint32_t pass;
+        uint32_t compression;
+        /// @brief crc32c of the stored bytes
+        uint32_t checksum;
+        uint64_t offset;
+        /// @brief number of stored bytes
+        uint64_t size;
+        /// @brief number of bytes after decompression
+        uint64_t raw_size;
+        /// @brief number of elements
+        uint64_t count;
+    };
+
+    const char LUT_FILE_MAGIC[8] = { 'R', 'C', 'M', 'L', 'U', 'T', 0, 0 };
+    const uint32_t LUT_FILE_VERSION = 3;
+    const uint32_t LUT_FILE_BYTE_ORDER = 0x01020304;
+
+    /// @brief section types, in the order that they appear in each pass
+    enum lut_file_section_type
+    {
+        LUT_FILE_KEYS,
+        LUT_FILE_TOTALS,
+        LUT_FILE_SUMS,
+        LUT_FILE_TABLE,
+        LUT_FILE_SECTIONS_PER_PASS
+    };
+
+    /// @brief section compression methods
+    enum lut_file_compression
+    {
+        LUT_FILE_RAW,
+        /// @brief (run length, value) byte pairs
+        LUT_FILE_RLE
+    };
+
+    /// @brief round a file offset up to the next 8 byte boundary
+    inline uint64_t lut_file_align (uint64_t offset)
+    {
+        return (offset + 7) & ~uint64_t (7);
+    }
+
+    /// @brief crc32c lookup table
+    struct crc32c_table
+    {
+        crc32c_table ()
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t x = i;
+                for (int k = 0; k < 8; ++k)
+                    x = (x >> 1) ^ (0x82F63B78 & (0 - (x & 1)));
+                t[i] = x;
+            }
+        }
+        uint32_t t[256];
+    };
+
+    /// @brief crc32c, one byte at a time
+    inline uint32_t crc32c_bytes (uint32_t crc, const unsigned char *p, size_t n)
+    {
+        static const crc32c_table table;
+        for (size_t i = 0; i < n; ++i)
+            crc = (crc >> 8) ^ table.t[(crc ^ p[i]) & 0xFF];
+        return crc;
+    }
+
+#if defined (__x86_64__)
+    /// @brief crc32c with the SSE 4.2 crc32 instruction
+    __attribute__ ((target ("sse4.2")))
+    inline uint32_t crc32c_sse42 (uint32_t crc, const unsigned char *p, size_t n)
+    {
+        uint64_t c = crc;
+        for (; n >= 8; n -= 8, p += 8)
+        {
+            uint64_t x;
+            memcpy (&x, p, sizeof (x));
+            c = __builtin_ia32_crc32di (c, x);
+        }
+        crc = c;
+        for (; n > 0; --n, ++p)
+            crc = __builtin_ia32_crc32qi (crc, *p);
+        return crc;
+    }
+#endif
+
+    /// @brief crc32c (Castagnoli) checksum
+    ///
+    /// @param p data
+    /// @param n number of bytes
+    /// @param crc checksum of the preceding data, for checksumming in pieces
+    inline uint32_t crc32c (const void *p, size_t n, uint32_t crc = 0)
+    {
+        const unsigned char *q = static_cast<const unsigned char *> (p);
+        crc = ~crc;
+#if defined (__x86_64__)
+        static const bool sse42 = __builtin_cpu_supports ("sse4.2");
+        if (sse42)
+            return ~crc32c_sse42 (crc, q, n);
+#endif
+        return ~crc32c_bytes (crc, q, n);
+    }
+
+    /// @brief run length encode bytes
+    ///
+    /// Dense tables are mostly runs of unseen contexts, which all map to
+    /// the same centre pixel, so they shrink a lot.
+    inline std::vector<unsigned char> rle_encode (const unsigned char *p, size_t n)
+    {
+        std::vector<unsigned char> e;
+        for (size_t i = 0; i < n; )
+        {
+            size_t j = i + 1;
+            while (j < n && j - i < 255 && p[j] == p[i])
+                ++j;
+            e.push_back (j - i);
+            e.push_back (p[i]);
+            i = j;
+        }
+        return e;
+    }
+
+    /// @brief decode run length encoded bytes
+    ///
+    /// @param p encoded bytes
+    /// @param n number of encoded bytes
+    /// @param q output, which must hold raw_size bytes
+    /// @param raw_size number of decoded bytes
+    inline void rle_decode (const unsigned char *p, size_t n, unsigned char *q, size_t raw_size)
+    {
+        size_t k = 0;
+        for (size_t i = 0; i + 1 < n; i += 2)
+        {
+            if (p[i] == 0 || k + p[i] > raw_size)
+                throw std::runtime_error ("corrupt lut file");
+            memset (q + k, p[i + 1], p[i]);
+            k += p[i];
+        }
+        if (n % 2 || k != raw_size)
+            throw std::runtime_error ("corrupt lut file");
+    }
+
+    /// @brief check a lut file's header
+    ///
+    /// @param h the header
+    /// @param context the context id of the reader
+    /// @param passes expected number of passes
+    inline void lut_file_check (const lut_file_header &h, uint32_t context, size_t passes)
+    {
+        if (memcmp (h.magic, LUT_FILE_MAGIC, sizeof (h.magic)) != 0)
+            throw std::runtime_error ("not a lut file");
+        if (h.version != LUT_FILE_VERSION)
+            throw std::runtime_error ("unsupported lut file version");
+        if (h.byte_order != LUT_FILE_BYTE_ORDER)
+            throw std::runtime_error ("lut file was written with a different byte order");
+        if (h.key_size != sizeof (uint32_t) || h.total_size != sizeof (uint64_t)
+            || h.sum_size != sizeof (uint64_t) || h.value_size != 1)
+            throw std::runtime_error ("lut file has unsupported value sizes");
+        if (h.context != context)
+            throw std::runtime_error ("lut file was trained with a different context");
+        if (h.passes != passes)
+            throw std::runtime_error ("lut file has the wrong number of passes");
+        if (h.sections != passes * LUT_FILE_SECTIONS_PER_PASS)
+            throw std::runtime_error ("lut file has the wrong number of sections");
+    }
+
+    /// @brief checksum a header and its section table
+    inline uint32_t lut_file_checksum (lut_file_header h, const lut_file_section *s)
+    {
+        h.checksum = 0;
+        return crc32c (s, h.sections * sizeof (lut_file_section), crc32c (&h, sizeof (h)));
+    }
+
+    /// @brief check a section table entry
+    ///
+    /// @param s the entry
+    /// @param n index of the entry
+    /// @param begin where the sections start
+    /// @param end size of the file
+    inline void lut_file_check (const lut_file_section &s, size_t n, uint64_t begin, uint64_t end)
+    {
+        const size_t sizes[LUT_FILE_SECTIONS_PER_PASS] = { sizeof (uint32_t), sizeof (uint64_t), sizeof (uint64_t), 1 };
+        if (s.type != n % LUT_FILE_SECTIONS_PER_PASS || s.pass != n / LUT_FILE_SECTIONS_PER_PASS)
+            throw std::runtime_error ("corrupt lut file section table");
+        if (s.offset % 8 || s.offset < begin)
+            throw std::runtime_error ("misaligned lut file");
+        if (s.offset > end || s.size > end - s.offset)
+            throw std::runtime_error ("truncated lut file");
+        if (s.raw_size != s.count * sizes[s.type])
+            throw std::runtime_error ("corrupt lut file section table");
+        if (s.compression == LUT_FILE_RAW ? s.size != s.raw_size : s.compression != LUT_FILE_RLE)
+            throw std::runtime_error ("corrupt lut file section table");
+    }
+
+    /// @brief check a mapped lut file's header and section table
+    ///
+    /// @param p start of the file
+    /// @param sz size of the file in bytes
+    /// @param context the context id of the reader
+    /// @param passes expected number of passes
+    ///
+    /// This does not look at the sections themselves, see
+    /// lut_file_verify ().
+    ///
+    /// @return the section table
+    inline const lut_file_section *lut_file_sections (const char *p, size_t sz, uint32_t context, size_t passes)
+    {
+        if (sz < sizeof (lut_file_header))
+            throw std::runtime_error ("not a lut file");
+        const lut_file_header &h = *reinterpret_cast<const lut_file_header *> (p);
+        lut_file_check (h, context, passes);
+        if (h.file_size != sz)
+            throw std::runtime_error ("truncated lut file");
+        const uint64_t begin = sizeof (h) + h.sections * sizeof (lut_file_section);
+        if (sz < begin)
+            throw std::runtime_error ("truncated lut file");
+        const lut_file_section *s = reinterpret_cast<const lut_file_section *> (p + sizeof (h));
+        if (lut_file_checksum (h, s) != h.checksum)
+            throw std::runtime_error ("corrupt lut file header");
+        for (size_t n = 0; n < h.sections; ++n)
+            lut_file_check (s[n], n, begin, sz);
+        return s;
+    }
+
+    /// @brief check a section's checksum
+    ///
+    /// @param p start of the file
+    /// @param s the section
+    inline void lut_file_verify (const char *p, const lut_file_section &s)
+    {
+        if (crc32c (p + s.offset, s.size) != s.checksum)
+            throw std::runtime_error ("corrupt lut file");
+    }
+
+    /// @brief get the contents of a section
+    ///
+    /// @param d stored bytes of the section, which have been verified
+    /// @param s the section
+    ///
+    /// @return the decompressed bytes
+    inline std::vector<unsigned char> lut_file_decode (const char *d, const lut_file_section &s)
+    {
+        std::vector<unsigned char> x (s.raw_size);
+        const unsigned char *u = reinterpret_cast<const unsigned char *> (d);
+        if (s.compression == LUT_FILE_RLE)
+            rle_decode (u, s.size, x.data (), x.size ());
+        else
+            std::copy (u, u + s.size, x.begin ());
+        return x;
+    }
+
+    /// @brief write a lut file
+    ///
+    /// Sections are added pass by pass, in lut_file_section_type order,
+    /// and then written all at once.
+    class lut_file_writer
+    {
+        public:
+        /// @brief constructor
+        ///
+        /// @param context context id
+        /// @param passes number of passes
+        lut_file_writer (uint32_t context, uint32_t passes)
+        {
+            memset (&h, 0, sizeof (h));
+            memcpy (h.magic, LUT_FILE_MAGIC, sizeof (h.magic));
+            h.version = LUT_FILE_VERSION;
+            h.byte_order = LUT_FILE_BYTE_ORDER;
+            h.context = context;
+            h.passes = passes;
+            h.key_size = sizeof (uint32_t);
+            h.total_size = sizeof (uint64_t);
+            h.sum_size = sizeof (uint64_t);
+            h.value_size = 1;
+        }
+        /// @brief add the next section
+        ///
+        /// @param p the elements, which must stay valid until write ()
+        /// @param count number of elements
+        /// @param width size of an element in bytes
+        /// @param compress run length encode the section
+        void add (const void *p, uint64_t count, size_t width, bool compress = false)
+        {
+            lut_file_section t;
+            memset (&t, 0, sizeof (t));
+            t.type = s.size () % LUT_FILE_SECTIONS_PER_PASS;
+            t.pass = s.size () / LUT_FILE_SECTIONS_PER_PASS;
+            t.count = count;
+            t.raw_size = count * width;
+            encoded.push_back (std::vector<unsigned char> ());
+            const char *d = static_cast<const char *> (p);
+            if (compress)
+            {
+                encoded.back () = rle_encode (reinterpret_cast<const unsigned char *> (d), t.raw_size);
+                d = reinterpret_cast<const char *> (encoded.back ().data ());
+                t.compression = LUT_FILE_RLE;
+                t.size = encoded.back ().size ();
+            }
+            else
+            {
+                t.compression = LUT_FILE_RAW;
+                t.size = t.raw_size;
+            }
+            add (t, d);
+        }
+        /// @brief add the next section as it was stored in another file
+        ///
+        /// @param t the section's table entry
+        /// @param d its stored bytes, which must stay valid until write ()
+        void add (const lut_file_section &t, const char *d)
+        {
+            s.push_back (t);
+            s.back ().type = (s.size () - 1) % LUT_FILE_SECTIONS_PER_PASS;
+            s.back ().pass = (s.size () - 1) / LUT_FILE_SECTIONS_PER_PASS;
+            s.back ().checksum = crc32c (d, t.size);
+            data.push_back (d);
+        }
+        void write (std::ostream &os)
+        {
+            if (s.size () != h.passes * LUT_FILE_SECTIONS_PER_PASS)
+                throw std::runtime_error ("lut file is missing sections");
+            h.sections = s.size ();
+            uint64_t offset = sizeof (h) + s.size () * sizeof (lut_file_section);
+            for (size_t n = 0; n < s.size (); ++n)
+            {
+                s[n].offset = offset;
+                offset = lut_file_align (offset + s[n].size);
+            }
+            h.file_size = offset;
+            h.checksum = lut_file_checksum (h, s.data ());
+            os.write (reinterpret_cast<const char *> (&h), sizeof (h));
+            os.write (reinterpret_cast<const char *> (s.data ()), s.size () * sizeof (lut_file_section));
+            const char pad[8] = { 0 };
+            for (size_t n = 0; n < s.size (); ++n)
+            {
+                os.write (data[n], s[n].size);
+                os.write (pad, lut_file_align (s[n].size) - s[n].size);
+            }
+            if (!os)
+                throw std::runtime_error ("could not write lut file");
+        }
+        private:
+        lut_file_header h;
+        std::vector<lut_file_section> s;
+        std::vector<const char *> data;
+        std::vector<std::vector<unsigned char>> encoded;
+    };
+
+    /// @brief read a lut file from a stream, a section at a time
+    class lut_file_reader
+    {
+        public:
+        /// @brief read and check the header and the section table
+        ///
+        /// @param is stream
+        /// @param context the context id of the reader
+        /// @param passes expected number of passes
+        lut_file_reader (std::istream &is, uint32_t context, size_t passes)
+            : is (is)
+            , next (0)
+        {
+            if (!is.read (reinterpret_cast<char *> (&h), sizeof (h)))
+                throw std::runtime_error ("could not read lut file header");
+            lut_file_check (h, context, passes);
+            s.resize (h.sections);
+            if (!is.read (reinterpret_cast<char *> (s.data ()), s.size () * sizeof (lut_file_section)))
+                throw std::runtime_error ("truncated lut file");
+            if (lut_file_checksum (h, s.data ()) != h.checksum)
+                throw std::runtime_error ("corrupt lut file header");
+            pos = sizeof (h) + s.size () * sizeof (lut_file_section);
+            for (size_t n = 0; n < s.size (); ++n)
+                lut_file_check (s[n], n, pos, h.file_size);
+        }
+        /// @brief read and check the next section
+        ///
+        /// @return the decompressed bytes
+        std::vector<unsigned char> read ()
+        {
+            if (next == s.size ())
+                throw std::runtime_error ("no more lut file sections");
+            const lut_file_section &t = s[next++];
+            // a stream can only skip forward
+            if (t.offset < pos)
+                throw std::runtime_error ("invalid lut file section offset");
+            is.ignore (t.offset - pos);
+            std::vector<char> d (t.size);
+            if (!is.read (d.data (), d.size ()))
+                throw std::runtime_error ("truncated lut file");
+            pos = t.offset + t.size;
+            if (crc32c (d.data (), d.size ()) != t.checksum)
+                throw std::runtime_error ("corrupt lut file");
+            return lut_file_decode (d.data (), t);
+        }
+        private:
+        std::istream &is;
+        lut_file_header h;
+        std::vector<lut_file_section> s;
+        size_t next;
+        uint64_t pos;
+    };
+
+    /// @brief read only memory mapped file
+    class mapped_file
+    {
+        public:
+        mapped_file ()
+            : p (0)
+            , sz (0)
+        { }
+        explicit mapped_file (const char *fn)
+            : p (0)
+            , sz (0)
+        {
+            open (fn);
+        }
+        ~mapped_file ()
+        {
+            close ();
+        }
+        void open (const char *fn)
+        {
+            close ();
+            const int fd = ::open (fn, O_RDONLY);
+            if (fd < 0)
+                throw std::runtime_error (std::string ("could not open ") + fn);
+            struct stat st;
+            if (fstat (fd, &st) != 0)
+            {
+                ::close (fd);
+                throw std::runtime_error (std::string ("could not stat ") + fn);
+            }
+            sz = st.st_size;
+            if (sz != 0)
+            {
+                void *m = mmap (0, sz, PROT_READ, MAP_SHARED, fd, 0);
+                if (m == MAP_FAILED)
+                {
+                    ::close (fd);
+                    sz = 0;
+                    throw std::runtime_error (std::string ("could not map ") + fn);
+                }
+                p = static_cast<const char *> (m);
+            }
+            // the mapping stays valid after the descriptor is closed
+            ::close (fd);
+        }
+        void close ()
+        {
+            if (p)
+                munmap (const_cast<char *> (p), sz);
+            p = 0;
+            sz = 0;
+        }
+        const char *data () const
+        {
+            return p;
+        }
+        size_t size () const
+        {
+            return sz;
+        }
+        private:
+        mapped_file (const mapped_file &);
+        mapped_file &operator= (const mapped_file &);
+        const char *p;
+        size_t sz;
+    };
+}
+
+#endif
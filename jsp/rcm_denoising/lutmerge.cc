@@ -0,0 +1,146 @@
+/// @file lutmerge.cc
+/// @brief combine partial luts that were trained on shards of a training set
+/// @author Jeff Perry <jeffsp@gmail.com>
+/// @version 1.0
+/// @date 2015-07-08
+
+#include "denoise.h"
+#include <memory>
+#include <queue>
+
+using namespace opp;
+using namespace std;
+using namespace denoise;
+
+const string usage = "usage: lutmerge partial.lut [partial.lut ...] > merged.lut";
+
+/// @brief the counts of one pass of a mapped lut file, in key order
+struct count_stream
+{
+    const uint32_t *keys;
+    const uint64_t *totals;
+    const uint64_t *sums;
+    size_t count;
+};
+
+/// @brief sum the counts of several passes
+///
+/// @param s the passes
+/// @param f called as f (key, total, sum) for each key, in key order
+///
+/// The passes are merged a key at a time, so none of them is loaded.
+template<typename F>
+void merge_counts (const vector<count_stream> &s, F f)
+{
+    // next key of each stream
+    typedef pair<uint32_t,size_t> head;
+    priority_queue<head,vector<head>,greater<head>> q;
+    vector<size_t> pos (s.size ());
+    for (size_t n = 0; n < s.size (); ++n)
+        if (s[n].count)
+            q.push (head (s[n].keys[0], n));
+    while (!q.empty ())
+    {
+        const uint32_t key = q.top ().first;
+        uint64_t total = 0;
+        uint64_t sum = 0;
+        while (!q.empty () && q.top ().first == key)
+        {
+            const size_t n = q.top ().second;
+            q.pop ();
+            total += s[n].totals[pos[n]];
+            sum += s[n].sums[pos[n]];
+            if (++pos[n] != s[n].count)
+                q.push (head (s[n].keys[pos[n]], n));
+        }
+        f (key, total, sum);
+    }
+}
+
+int main (int argc, char **argv)
+{
+    try
+    {
+        if (argc < 2)
+            throw runtime_error (usage);
+        typedef codec<context> codec_t;
+        vector<unique_ptr<mapped_file>> f;
+        for (int n = 1; n < argc; ++n)
+            f.emplace_back (new mapped_file (argv[n]));
+        if (f[0]->size () < sizeof (lut_file_header))
+            throw runtime_error ("not a lut file");
+        // the last pass in the files is the one that gets merged
+        const size_t passes = reinterpret_cast<const lut_file_header *> (f[0]->data ())->passes;
+        if (passes == 0 || passes > PASSES)
+            throw runtime_error ("lut file has the wrong number of passes");
+        const size_t last = passes - 1;
+        const size_t earlier = last * LUT_FILE_SECTIONS_PER_PASS;
+        vector<const lut_file_section *> t;
+        vector<count_stream> s;
+        for (size_t n = 0; n < f.size (); ++n)
+        {
+            const char *p = f[n]->data ();
+            if (f[n]->size () < sizeof (lut_file_header))
+                throw runtime_error (string (argv[n + 1]) + " is not a lut file");
+            // the table below is sized for codec_t
+            if (reinterpret_cast<const lut_file_header *> (p)->context != context::id ())
+                throw runtime_error (string (argv[n + 1]) + " was trained with a different context");
+            t.push_back (lut_file_sections (p, f[n]->size (), context::id (), passes));
+            // the earlier passes must be the same in every file
+            for (size_t k = 0; k < earlier; ++k)
+            {
+                if (n == 0)
+                    lut_file_verify (p, t[n][k]);
+                else if (t[n][k].size != t[0][k].size || t[n][k].checksum != t[0][k].checksum)
+                    throw runtime_error (string (argv[n + 1]) + " was trained on different earlier passes");
+            }
+            const lut_file_section *u = t[n] + earlier;
+            for (size_t k = LUT_FILE_KEYS; k < LUT_FILE_TABLE; ++k)
+            {
+                if (u[k].compression != LUT_FILE_RAW)
+                    throw runtime_error ("compressed counts can't be merged");
+                lut_file_verify (p, u[k]);
+            }
+            count_stream c;
+            c.keys = reinterpret_cast<const uint32_t *> (p + u[LUT_FILE_KEYS].offset);
+            c.totals = reinterpret_cast<const uint64_t *> (p + u[LUT_FILE_TOTALS].offset);
+            c.sums = reinterpret_cast<const uint64_t *> (p + u[LUT_FILE_SUMS].offset);
+            c.count = u[LUT_FILE_KEYS].count;
+            if (u[LUT_FILE_TOTALS].count != c.count || u[LUT_FILE_SUMS].count != c.count)
+                throw runtime_error ("corrupt lut file");
+            for (size_t k = 0; k < c.count; ++k)
+                if (c.keys[k] >= codec_t::dense_table_size ())
+                    throw runtime_error (string (argv[n + 1]) + " has a context that is out of range");
+            s.push_back (c);
+        }
+        vector<uint32_t> keys;
+        vector<uint64_t> totals;
+        vector<uint64_t> sums;
+        vector<unsigned char> table (codec_t::dense_table_size ());
+        for (size_t n = 0; n < table.size (); ++n)
+            table[n] = context::center (n);
+        merge_counts (s, [&] (uint32_t key, uint64_t total, uint64_t sum)
+        {
+            keys.push_back (key);
+            totals.push_back (total);
+            sums.push_back (sum);
+            table[key] = codec_t::output (key, total, sum);
+        });
+        clog << keys.size () << " contexts in pass " << passes << endl;
+        // the earlier passes are copied as they are
+        lut_file_writer w (context::id (), passes);
+        for (size_t k = 0; k < earlier; ++k)
+            w.add (t[0][k], f[0]->data () + t[0][k].offset);
+        w.add (keys.data (), keys.size (), sizeof (uint32_t));
+        w.add (totals.data (), totals.size (), sizeof (uint64_t));
+        w.add (sums.data (), sums.size (), sizeof (uint64_t));
+        w.add (table.data (), table.size (), 1, t[0][earlier + LUT_FILE_TABLE].compression != LUT_FILE_RAW);
+        w.write (cout);
+        return 0;
+    }
+    catch (const exception &e)
+    {
+        cerr << e.what () << endl;
+        return -1;
+    }
+}
@@ -1,40 +1,209 @@
+#include "bounded_queue.h"
 #include "denoise.h"
+#include <atomic>
+#include <sstream>
+#include <thread>
 
 using namespace opp;
 using namespace std;
 using namespace denoise;
 using namespace horny_toad;
 
-const string usage = "usage: mklut < file_list.txt > fn.lut";
+const string usage = "usage: mklut [--compress] [spill_dir] < file_list.txt > fn.lut\n"
+    "       mklut [--compress] --pass 0 < shard_list.txt > partial.lut\n"
+    "       mklut [--compress] --pass n merged.lut < shard_list.txt > partial.lut";
 
-int main (int argc, char **)
+/// @brief get the name of the file that holds a spilled restored image
+string spill_name (const string &dir, size_t n)
+{
+    ostringstream s;
+    s << dir << "/" << n << ".pgm";
+    return s.str ();
+}
+
+/// @brief a clean image and its noisy image, partly restored
+struct training_pair
+{
+    size_t i;
+    image_t p;
+    image_t t;
+    /// @brief number of passes that t has been restored through
+    size_t restored;
+    void swap (training_pair &x)
+    {
+        std::swap (i, x.i);
+        p.swap (x.p);
+        t.swap (x.t);
+        std::swap (restored, x.restored);
+    }
+};
+
+/// @brief train one pass
+///
+/// @param c the codec, whose earlier passes are finalized
+/// @param fns clean and noisy image file names
+/// @param pass the pass to train
+/// @param from_files read the noisy images from fns, rather than the
+/// restored images that the previous pass kept
+/// @param keep keep the restored images for the next pass
+/// @param spill_dir where restored images are kept, or empty to keep
+/// them in ps and ts
+/// @param ps clean images kept between passes
+/// @param ts restored images kept between passes
+void train_pass (multi_codec<PASSES> &c, const vector<string> &fns, size_t pass,
+    bool from_files, bool keep, const string &spill_dir, images_t &ps, images_t &ts)
+{
+    const size_t pairs = fns.size () / 2;
+    // a reader thread keeps the workers supplied with pairs, so they
+    // never wait on the disk
+    bounded_queue<training_pair> q (2 * omp_get_max_threads ());
+    atomic<size_t> done (0);
+    mutex failure_mutex;
+    string failure;
+    auto fail = [&] (const exception &e)
+    {
+        lock_guard<mutex> lock (failure_mutex);
+        if (failure.empty ())
+            failure = e.what ();
+        q.close ();
+    };
+    thread reader ([&] ()
+    {
+        try
+        {
+            for (size_t i = 0; i < pairs; ++i)
+            {
+                // progress is reported here, off the workers' path
+                clog << "pass " << pass + 1 << "/" << c.lut_passes ()
+                    << " reading " << i + 1 << "/" << pairs
+                    << ", " << done << " done"
+                    << " " << fns[2 * i]
+                    << " " << fns[2 * i + 1] << endl;
+                training_pair x;
+                x.i = i;
+                if (from_files || !spill_dir.empty ())
+                    x.p = read_grayscale (fns[2 * i].c_str ());
+                else
+                    x.p.swap (ps[i]);
+                if (from_files)
+                    x.t = read_grayscale (fns[2 * i + 1].c_str ());
+                else if (!spill_dir.empty ())
+                    x.t = read_grayscale (spill_name (spill_dir, i).c_str ());
+                else
+                    x.t.swap (ts[i]);
+                x.restored = from_files ? 0 : pass - 1;
+                if (!q.push (x))
+                    break;
+            }
+        }
+        catch (const exception &e)
+        {
+            fail (e);
+        }
+        q.close ();
+    });
+#pragma omp parallel
+    {
+        // each worker counts into its own table, so the workers never
+        // touch the same memory until the merge
+        lut1<size_t> l;
+        training_pair x;
+        while (q.pop (x))
+        {
+            try
+            {
+                // bring the restored image up to this pass
+                for (size_t n = x.restored; n < pass; ++n)
+                    x.t = c.denoise (x.t, n);
+                c.update_restored (x.p, x.t, pass, l);
+                ++done;
+                if (!keep)
+                    continue;
+                if (!spill_dir.empty ())
+                {
+                    ofstream ofs (spill_name (spill_dir, x.i).c_str ());
+                    if (!ofs)
+                        throw runtime_error ("could not open spill file for writing");
+                    write_pnm (ofs, x.t.cols (), x.t.rows (), x.t);
+                }
+                else
+                {
+                    ps[x.i].swap (x.p);
+                    ts[x.i].swap (x.t);
+                }
+            }
+            catch (const exception &e)
+            {
+                fail (e);
+            }
+        }
+#pragma omp critical
+        c.merge (pass, l);
+    }
+    reader.join ();
+    if (!failure.empty ())
+        throw runtime_error (failure);
+    c.finalize (pass);
+}
+
+int main (int argc, char **argv)
 {
     try
     {
-        if (argc != 1)
-            throw runtime_error (usage);
+        // compressed tables are smaller, but have to be copied into
+        // memory to be used
+        const bool compress = argc > 1 && string (argv[1]) == "--compress";
+        if (compress)
+        {
+            --argc;
+            ++argv;
+        }
+        // with --pass, train a single pass on a shard of the training
+        // set, on top of the earlier passes from a lut that lutmerge
+        // made, and write a partial lut
+        const bool shard = argc > 1 && string (argv[1]) == "--pass";
+        size_t first = 0;
+        string base;
+        string spill_dir;
+        if (shard)
+        {
+            if (argc < 3 || argc > 4)
+                throw runtime_error (usage);
+            first = atoi (argv[2]);
+            if (first >= PASSES || (first != 0) != (argc == 4))
+                throw runtime_error (usage);
+            if (argc == 4)
+                base = argv[3];
+        }
+        else
+        {
+            if (argc > 2)
+                throw runtime_error (usage);
+            // if a spill directory is given, the restored images are kept
+            // there between passes instead of in memory
+            spill_dir = argc == 2 ? argv[1] : "";
+        }
         vector<string> fns = horny_toad::readwords<string> (cin);
         clog << fns.size () << " files to process" << endl;
         if (fns.size () % 2)
             throw runtime_error ("you must supply an even number of file names");
         multi_codec<PASSES> c;
-        for (size_t pass = 0; pass < c.lut_passes (); ++pass)
+        if (!base.empty ())
         {
-            size_t k = fns.size () / 2;
-#pragma omp parallel for schedule (dynamic)
-            for (size_t n = 0; n < fns.size (); n += 2)
-            {
-#pragma omp critical
-                clog << "pass " << pass+1 << "/" << c.lut_passes () << " " << k--
-                    << " processing " << fns[n]
-                    << " " << fns[n + 1] << endl;
-                image_t p = read_grayscale (fns[n].c_str ());
-                image_t q = read_grayscale (fns[n + 1].c_str ());
-                c.update (p, q, pass);
-            }
+            clog << "reading " << base << endl;
+            ifstream ifs (base.c_str ());
+            if (!ifs)
+                throw runtime_error ("could not open lut file for reading");
+            c.read (ifs, first);
         }
+        const size_t last = shard ? first + 1 : c.lut_passes ();
+        // clean images, and noisy images restored up to the current pass
+        images_t ps (fns.size () / 2);
+        images_t ts (fns.size () / 2);
+        for (size_t pass = first; pass < last; ++pass)
+            train_pass (c, fns, pass, pass == first, pass + 1 < last, spill_dir, ps, ts);
         clog << "writing lut" << endl;
-        cout << c;
+        c.write (cout, last, compress);
         return 0;
     }
     catch (const exception &e)